@@ -191,16 +191,26 @@ void loop() {
             if (msg.text.equalsIgnoreCase("/takePhoto")) {
                 Serial.println("\nSending Photo from CAM");          
 
+            #if KEEP_IMAGE
                 // Take picture and save to file
                 String myFile = takePicture(filesystem);
                 if(myFile != "") {
                     if (!myBot.sendPhotoByFile(msg.sender.id, myFile, filesystem))
                       Serial.println("Photo send failed");       
-                    //If you don't need to keep image in memory, delete it 
-                    if(KEEP_IMAGE == false){
-                        filesystem.remove("/" + myFile);
-                    }
                 }
+            #else
+                // If you don't need to keep image in memory, send the frame buffer directly
+                ledcWrite(15, 255);     // Flash led ON
+                camera_fb_t * fb = esp_camera_fb_get();
+                ledcWrite(15, 0);       // Flash led OFF
+                if(fb) {
+                    if (!myBot.sendPhotoFromBuffer(msg.sender.id, fb->buf, fb->len))
+                      Serial.println("Photo send failed");
+                    esp_camera_fb_return(fb);
+                }
+                else
+                    Serial.println("Camera capture failed");
+            #endif
             } 
             else {
                 Serial.print("\nText message received: ");
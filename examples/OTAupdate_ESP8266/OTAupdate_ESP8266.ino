@@ -7,11 +7,9 @@
 */
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
-#include <ESP8266httpUpdate.h>
 #include "AsyncTelegram.h"
 
 AsyncTelegram myBot;
-WiFiClientSecure client;
 
 const char* ssid = "XXXXXXXX";     		  // REPLACE XXXXXXXX WITH YOUR WIFI SSID
 const char* pass = "XXXXXXXX";     		  // REPLACE XXXXXXXX YOUR WIFI PASSWORD, IF ANY
@@ -29,13 +27,6 @@ void setup() {
 	WiFi.begin(ssid, pass);
 	delay(500);
 
-  // We have to handle reboot manually after sync with TG server
-  ESPhttpUpdate.rebootOnUpdate(false);
-
-  // Create client for rom download
-  client.setInsecure();
-  client.setNoDelay(true);
-  
 	while (WiFi.status() != WL_CONNECTED) {
 		Serial.print('.');
 		delay(100);
@@ -74,42 +65,22 @@ void loop() {
     switch (msg.messageType) {
       case MessageDocument :
         if (msg.document.file_exists) {
-          if (msg.text.equalsIgnoreCase("fw")) {
-            // Caption is 'fw' and file exist
+          if (msg.text.equalsIgnoreCase("fw") || msg.text.startsWith("fw ")) {
+            // Caption is 'fw' (optionally followed by the MD5 or SHA-256 of the file) and file exist
             String report = "Update started...\nFile name: " 
                            + String(msg.document.file_name)
                            + "\nFile size: "
                            + String(msg.document.file_size);
             myBot.sendMessage(msg, report.c_str());
 
-            // Install firmware update
-            t_httpUpdate_return ret = ESPhttpUpdate.update(client, msg.document.file_path);
-            switch (ret)
-            {
-              case HTTP_UPDATE_FAILED:
-                report = "HTTP_UPDATE_FAILED Error (" 
-                  + String(ESPhttpUpdate.getLastError()) 
-                  + "): " 
-                  + ESPhttpUpdate.getLastErrorString();
-                myBot.sendMessage(msg, report.c_str());
-                break;
-
-              case HTTP_UPDATE_NO_UPDATES:
-                myBot.sendMessage(msg, "HTTP_UPDATE_NO_UPDATES");
-                break;
+            // Install firmware update: the file is written directly to flash, then
+            // the bot is synced with telegram (to prevent cyclic reboot) and the board restarts
+            String hash = msg.text.substring(3);
+            hash.trim();
+            myBot.updateFirmware(msg.document, hash.length() > 0 ? hash.c_str() : nullptr);
 
-              case HTTP_UPDATE_OK:
-                myBot.sendMessage(msg, "UPDATE OK.\nRestarting...");
-                // Wait until bot synced with telegram to prevent cyclic reboot
-                while (!myBot.getUpdates()) {
-                  Serial.print(".");
-                  delay(50);
-                }
-                ESP.restart();
-                break;
-              default:
-                break;
-            }
+            // Only if something went wrong
+            myBot.sendMessage(msg, "UPDATE FAILED (check the serial log)");
           } else {
             myBot.sendMessage(msg, "Error: file caption is not 'fw'");
           }
@@ -121,7 +92,7 @@ void loop() {
         if (msg.text.equalsIgnoreCase("/version")) {
           myBot.sendMessage(msg, "Version: 1.0");
         } else {
-          myBot.sendMessage(msg, "Send firmware binary file ###.bin with caption 'fw'");
+          myBot.sendMessage(msg, "Send firmware binary file ###.bin with caption 'fw' (or 'fw <md5/sha256>')");
         }
         break;
     }			
@@ -0,0 +1,207 @@
+/*
+Name:        benchmark.ino
+Created:     16/10/2026
+Description: measure library performance on the device, to catch regressions before release.
+             Send these commands to the bot:
+             /bench_send [n]    -> send n messages to the chat (messages/s, sendMessage() round trip latency)
+             /bench_echo [n]    -> echo the next n messages (messages/s, getNewMessage() -> sendMessage() latency)
+                                   (i.e. forward a burst of messages to the bot)
+             /bench_upload [kb] -> upload a kb KBytes document from memory (MB/s)
+             For each test free heap and largest free block before/after are also reported, with the
+             JSON allocations per operation (and how many of them didn't fit in the arena and went to the heap).
+
+             To test against a local Bot API server instead of api.telegram.org,
+             call setServer() before begin() (see setup()).
+*/
+
+#include <Arduino.h>
+#include "AsyncTelegram.h"
+AsyncTelegram myBot;
+
+const char* ssid = "XXXXXXXX";     		// REPLACE mySSID WITH YOUR WIFI SSID
+const char* pass = "XXXXXXXX";     		// REPLACE myPassword YOUR WIFI PASSWORD, IF ANY
+const char* token = "XXXXXXXXXXXXXXXXXXXX";   	// REPLACE myToken WITH YOUR TELEGRAM BOT TOKEN
+
+#define MAX_SAMPLES		100
+
+uint32_t samples[MAX_SAMPLES];
+uint16_t samplesCount = 0;
+
+// echo test status
+uint16_t echoTarget = 0;
+uint32_t echoStart = 0;
+int64_t  echoChat = 0;
+
+uint32_t heapBefore, blockBefore;
+JsonArena::Stats arenaBefore;
+
+
+uint32_t maxFreeBlock() {
+#if defined(ESP32)
+	return ESP.getMaxAllocHeap();
+#else
+	return ESP.getMaxFreeBlockSize();
+#endif
+}
+
+
+void startTest() {
+	samplesCount = 0;
+	heapBefore = ESP.getFreeHeap();
+	blockBefore = maxFreeBlock();
+	arenaBefore = myBot.getArenaStats();
+}
+
+
+void addSample(uint32_t value) {
+	if (samplesCount < MAX_SAMPLES)
+		samples[samplesCount++] = value;
+}
+
+
+int compareSamples(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+// print the results on serial and send them to the chat
+void report(const TBMessage &msg, const char* test, uint32_t count, uint32_t elapsed) {
+	char text[384];
+	uint32_t p50 = 0, p99 = 0;
+	if (samplesCount > 0) {
+		qsort(samples, samplesCount, sizeof(uint32_t), compareSamples);
+		p50 = samples[samplesCount / 2];
+		p99 = samples[(samplesCount * 99) / 100 < samplesCount ? (samplesCount * 99) / 100 : samplesCount - 1];
+	}
+	JsonArena::Stats arena = myBot.getArenaStats();
+	uint32_t allocations = arena.allocations - arenaBefore.allocations;
+	uint32_t fallbacks = arena.fallbacks - arenaBefore.fallbacks;
+	snprintf(text, sizeof(text),
+		"%s\n%u operations in %u ms (%.2f/s)\nlatency p50 %u us, p99 %u us\n"
+		"free heap %u -> %u\nmax block %u -> %u\n"
+		"JSON allocations %.1f/op (%u from heap)",
+		test, (unsigned) count, (unsigned) elapsed, elapsed ? count * 1000.0 / elapsed : 0.0, (unsigned) p50, (unsigned) p99,
+		(unsigned) heapBefore, (unsigned) ESP.getFreeHeap(), (unsigned) blockBefore, (unsigned) maxFreeBlock(),
+		count ? (float) allocations / count : 0.0, (unsigned) fallbacks);
+	Serial.println(text);
+	myBot.sendMessage(msg, text);
+}
+
+
+void benchSend(const TBMessage &msg, const char* args) {
+	uint16_t count = atoi(args) > 0 ? atoi(args) : 20;
+	startTest();
+	uint32_t start = millis();
+	for (uint16_t i = 0; i < count; i++) {
+		char text[32];
+		snprintf(text, sizeof(text), "Message %u of %u", i + 1, count);
+		uint32_t t0 = micros();
+		myBot.sendMessage(msg, text);
+		// sendMessage() only queues the request (ESP32) or writes it (ESP8266):
+		// wait for the server reply to measure the whole round trip
+		while (myBot.pendingRequests() > 0) {
+			myBot.getUpdates();		// keep the library running (ESP8266 reads the replies here)
+			yield();
+		}
+		addSample(micros() - t0);
+	}
+	report(msg, "sendMessage()", count, millis() - start);
+}
+
+
+void benchEcho(const TBMessage &msg, const char* args) {
+	echoTarget = atoi(args) > 0 ? atoi(args) : 20;
+	echoChat = msg.chatId;
+	echoStart = 0;
+	startTest();
+	char text[64];
+	snprintf(text, sizeof(text), "Waiting for %u messages", echoTarget);
+	myBot.sendMessage(msg, text);
+}
+
+
+void benchUpload(const TBMessage &msg, const char* args) {
+	size_t size = (atoi(args) > 0 ? atoi(args) : 64) * 1024UL;
+	uint8_t* data = (uint8_t*) malloc(size);
+	if (data == nullptr) {
+		myBot.sendMessage(msg, "Not enough memory");
+		return;
+	}
+	for (size_t i = 0; i < size; i++)
+		data[i] = i;
+
+	bool uploaded = false;
+	myBot.onUploadDone([&uploaded](bool ok, const char* fileId) { uploaded = ok; });
+
+	startTest();
+	heapBefore += size;		// buffer is not part of the library usage
+	uint32_t start = millis();
+	myBot.sendDocumentFromBuffer(msg, data, size, "benchmark.bin", "application/octet-stream");
+	uint32_t elapsed = millis() - start;
+	free(data);
+	myBot.onUploadDone(nullptr);
+	addSample(elapsed * 1000UL);
+
+	char text[96];
+	snprintf(text, sizeof(text), "upload %s: %u bytes in %u ms (%.3f MB/s)",
+		uploaded ? "ok" : "failed", (unsigned) size, (unsigned) elapsed, elapsed ? size / 1000.0 / elapsed : 0.0);
+	report(msg, text, 1, elapsed);
+}
+
+
+void setup() {
+	// initialize the Serial
+	Serial.begin(115200);
+	Serial.println("Starting TelegramBot...");
+
+	WiFi.setAutoConnect(true);
+	WiFi.mode(WIFI_STA);
+
+	WiFi.begin(ssid, pass);
+	delay(500);
+	while (WiFi.status() != WL_CONNECTED) {
+		Serial.print('.');
+		delay(500);
+	}
+
+	myBot.setClock("CET-1CEST,M3.5.0,M10.5.0/3");
+
+	// Fastest polling: long polling and no wait between requests
+	myBot.setUpdateTime(500);
+	myBot.enableLongPolling(true);
+	myBot.setTelegramToken(token);
+	// Local Bot API server (host, port, TLS), i.e. a fake server on the PC
+	// myBot.setServer("192.168.1.10", 8081, false);
+
+	// Check if all things are ok
+	Serial.print("\nTest Telegram connection... ");
+	myBot.begin() ? Serial.println("OK") : Serial.println("NOK");
+
+	myBot.onCommand("/bench_send", benchSend);
+	myBot.onCommand("/bench_echo", benchEcho);
+	myBot.onCommand("/bench_upload", benchUpload);
+}
+
+
+void loop() {
+	// a variable to store telegram message data
+	TBMessage msg;
+
+	// if there is an incoming message...
+	uint32_t t0 = micros();
+	if (myBot.getNewMessage(msg)) {
+		if (echoTarget == 0 || msg.chatId != echoChat) {
+			myBot.sendMessage(msg, "Try /bench_send, /bench_echo or /bench_upload");
+			return;
+		}
+
+		if (echoStart == 0)
+			echoStart = millis();
+		myBot.sendMessage(msg, msg.text);
+		addSample(micros() - t0);
+
+		if (--echoTarget == 0)
+			report(msg, "getNewMessage() -> sendMessage()", samplesCount, millis() - echoStart);
+	}
+}
@@ -6,7 +6,8 @@ Description: a simple example that do:
              1) parse incoming messages
              2) if "LIGHT ON" message is received, turn on the onboard LED
              3) if "LIGHT OFF" message is received, turn off the onboard LED
-             4) otherwise, reply to sender with a welcome message
+             4) /light_on and /light_off commands do the same using the command router
+             5) otherwise, reply to sender with a welcome message
 
 */
 
@@ -51,6 +52,15 @@ void setup() {
 	pinMode(LED, OUTPUT);
 	digitalWrite(LED, HIGH); // turn off the led (inverted logic!)
 
+	// commands are dispatched by the library: getNewMessage() doesn't return them
+	myBot.onCommand("/light_on", [](const TBMessage &msg, const char* args) {
+		digitalWrite(LED, LOW);
+		myBot.sendMessage(msg, "Light is now ON");
+	});
+	myBot.onCommand("/light_off", [](const TBMessage &msg, const char* args) {
+		digitalWrite(LED, HIGH);
+		myBot.sendMessage(msg, "Light is now OFF");
+	});
 }
 
 void loop() {
@@ -73,7 +83,7 @@ void loop() {
 			String reply;
 			reply = "Welcome " ;
 			reply += msg.sender.username;
-			reply += ".\nTry LIGHT ON or LIGHT OFF (case insensitive)";
+			reply += ".\nTry LIGHT ON or LIGHT OFF (case insensitive), /light_on or /light_off";
 			myBot.sendMessage(msg, reply);             // and send it
 		}
 	}
@@ -0,0 +1,57 @@
+/*
+ Name:        webhook.ino
+ Description: receive the messages with a webhook instead of polling the server.
+              Telegram server POSTs every update to a public HTTPS address as soon as it arrives:
+              a reverse proxy (i.e. nginx) with a valid certificate has to forward the requests
+              to http://<device ip>:8080/ in plain HTTP.
+              The webhook can be tested without Telegram, replaying an update from a PC:
+              curl -H "X-Telegram-Bot-Api-Secret-Token: mySecret" -d @update.json http://<device ip>:8080/
+*/
+#include <Arduino.h>
+#include "AsyncTelegram.h"
+AsyncTelegram myBot;
+
+const char* ssid = "XXXXXXXX";     		// REPLACE mySSID WITH YOUR WIFI SSID
+const char* pass = "XXXXXXXX";     		// REPLACE myPassword YOUR WIFI PASSWORD, IF ANY
+const char* token = "XXXXXXXXXXXXXXXXXXXX";   	// REPLACE myToken WITH YOUR TELEGRAM BOT TOKEN
+
+const char* webhookUrl = "https://example.com/telegram";	// REPLACE WITH THE PUBLIC ADDRESS OF YOUR PROXY
+const char* secret = "mySecret";							// only requests with this token are accepted
+
+
+void setup() {
+	// initialize the Serial
+	Serial.begin(115200);
+	Serial.println("Starting TelegramBot...");
+
+	WiFi.mode(WIFI_STA);
+	WiFi.begin(ssid, pass);
+	delay(500);
+	while (WiFi.status() != WL_CONNECTED) {
+		Serial.print('.');
+		delay(500);
+	}
+	Serial.print("\nIP address: ");
+	Serial.println(WiFi.localIP());
+
+	myBot.setClock("CET-1CEST,M3.5.0,M10.5.0/3");
+	myBot.setTelegramToken(token);
+	Serial.print("\nTest Telegram connection... ");
+	myBot.begin() ? Serial.println("OK") : Serial.println("NOK");
+
+	// Echo every text message
+	myBot.onMessage(MessageText, [](TBMessage &msg) {
+		Serial.printf("Message from %s: %s\n", msg.sender.username, msg.text.c_str());
+		myBot.sendMessage(msg, msg.text);
+	});
+
+	Serial.print("Set webhook... ");
+	myBot.setWebhook(webhookUrl, WEBHOOK_PORT, secret) ? Serial.println("OK") : Serial.println("NOK");
+	// myBot.deleteWebhook() goes back to getUpdates polling
+}
+
+
+void loop() {
+	// Messages are passed to the handlers as soon as they are POSTed by Telegram server
+	myBot.handleMessages(100);
+}
@@ -3,23 +3,276 @@
 #define ARDUINOJSON_DECODE_UNICODE  1
 
 #include "AsyncTelegram.h"
+#if defined(ESP32)
+    #include <Update.h>
+    #include <mbedtls/sha256.h>
+    #include "DoubleBuffer.h"
+#else
+    #include <Updater.h>
+    #include <bearssl/bearssl_hash.h>
+#endif
 
-#if DEBUG_ENABLE
-#define debugJson(X, Y)  { log_debug(); Serial.println(); serializeJsonPretty(X, Y); Serial.println();}
-#define errorJson(E)  { log_error(); Serial.println(); Serial.println(E);}
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+// Whole JSON documents are printed only to Serial (not stored in LogBuffer)
+#define debugJson(X, Y)  { if (!LogBuffer::enabled()) { log_debug("\n"); serializeJsonPretty(X, Y); Serial.println(); } }
 #else
 #define debugJson(X, Y)
-#define errorJson(E)
+#endif
+#define errorJson(E)  log_error("%s\n", (const char*) (E))
+
+// Only these fields of getUpdates reply will be stored in memory (ArduinoJson filter)
+static const char updatesFilter[] PROGMEM = "{\"ok\":true,\"error_code\":true,\"description\":true,"
+    "\"parameters\":{\"retry_after\":true},\"result\":[{\"update_id\":true,"
+    "\"callback_query\":{\"id\":true,\"data\":true,\"chat_instance\":true,"
+        "\"from\":{\"id\":true,\"username\":true,\"first_name\":true,\"last_name\":true},"
+        "\"message\":{\"message_id\":true,\"text\":true,\"date\":true,\"chat\":{\"id\":true}}},"
+    "\"message\":{\"message_id\":true,\"date\":true,\"text\":true,\"caption\":true,"
+        "\"chat\":{\"id\":true,\"title\":true},"
+        "\"from\":{\"id\":true,\"username\":true,\"first_name\":true,\"last_name\":true},"
+        "\"location\":true,\"contact\":true,\"document\":{\"file_id\":true,\"file_name\":true},"
+        "\"reply_to_message\":{\"message_id\":true}}}]}";
+
+// ArduinoJson custom reader: parse the body of a server reply directly from the client stream,
+// without reading over the reply length (next reply could be already in the same stream)
+class ReplyReader
+{
+public:
+    ReplyReader(Stream &stream, int32_t length) : m_stream(stream), m_left(length) {}
+
+    int read() {
+        char c;
+        if (m_left == 0 || m_stream.readBytes(&c, 1) != 1)
+            return -1;
+        if (m_left > 0)
+            m_left--;
+        return (uint8_t) c;
+    }
+
+    size_t readBytes(char* buffer, size_t length) {
+        if (m_left >= 0 && length > (size_t) m_left)
+            length = m_left;
+        size_t n = m_stream.readBytes(buffer, length);
+        if (m_left > 0)
+            m_left -= n;
+        return n;
+    }
+
+    // discard what is left of the reply body (only if length is known)
+    void flush() {
+        char buffer[64];
+        while (m_left > 0 && readBytes(buffer, sizeof(buffer)) > 0)
+            yield();
+    }
+
+private:
+    Stream  &m_stream;
+    int32_t m_left;
+};
+
+
+// Collect small writes in a stack buffer before sending them to the client
+// (each write call on the TLS client can produce a new record)
+class BufferedPrint : public Print
+{
+public:
+    BufferedPrint(Print &out) : m_out(out) {}
+    ~BufferedPrint() { flush(); }
+
+    size_t write(uint8_t c) override {
+        if (m_length == sizeof(m_buffer))
+            flush();
+        m_buffer[m_length++] = c;
+        return 1;
+    }
+
+    size_t write(const uint8_t *data, size_t size) override {
+        if (m_length + size > sizeof(m_buffer)) {
+            flush();
+            if (size >= sizeof(m_buffer))
+                return m_out.write(data, size);
+        }
+        memcpy(m_buffer + m_length, data, size);
+        m_length += size;
+        return size;
+    }
+
+    void flush() {
+        if (m_length > 0)
+            m_out.write(m_buffer, m_length);
+        m_length = 0;
+    }
+
+private:
+    Print   &m_out;
+    uint8_t m_buffer[256];
+    size_t  m_length = 0;
+};
+
+
+// Write to a memory buffer (no more than its size)
+class BufferWriter : public Print
+{
+public:
+    BufferWriter(uint8_t* buffer, size_t size) : m_buffer(buffer), m_size(size) {}
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+
+    size_t write(const uint8_t *data, size_t size) override {
+        if (m_length + size > m_size)
+            return 0;
+        memcpy(m_buffer + m_length, data, size);
+        m_length += size;
+        return size;
+    }
+
+private:
+    uint8_t *m_buffer;
+    size_t  m_size;
+    size_t  m_length = 0;
+};
+
+
+// Request bodies for sendRequest()
+struct RawBody {
+    const char* json;
+    void write(JsonWriter &out) const { out.raw(json); }
+};
+
+struct MessageBody {
+    int64_t     chatId;
+    const char* channel;        // "@channel" instead of chatId
+    const char* text;
+    const char* parseMode;
+    bool        silent;
+    bool        forceReply;
+    const char* keyboard;       // JSON keyboard (or nullptr)
+    const KeyboardLayout* layout;
+    const char* const* args = nullptr;  // text is a template with %s for these (escaped) arguments
+    size_t      argsCount = 0;
+
+    void write(JsonWriter &out) const {
+        static const char forceReplyFields[] = "\"selective\":true,\"force_reply\":true";
+        out.raw("{\"chat_id\":");
+        if (channel != nullptr)
+            out.quoted(channel);
+        else
+            out.number(chatId);
+        out.raw(",\"text\":");
+        if (args != nullptr)
+            out.quotedFormat(text, args, argsCount, parseEscape());
+        else
+            out.quoted(text);
+        if (parseMode != nullptr) {
+            out.raw(",\"parse_mode\":");
+            out.quoted(parseMode);
+        }
+        if (silent)
+            out.raw(",\"disable_notification\":true");
+        // Keyboard JSON is copied as-is
+        if (layout != nullptr) {
+            out.raw(",\"reply_markup\":");
+            layout->appendJSON(out, forceReply ? forceReplyFields : nullptr);
+        }
+        else if (keyboard != nullptr && *keyboard != '\0') {
+            out.raw(",\"reply_markup\":");
+            out.object(keyboard, forceReply ? forceReplyFields : nullptr);
+        }
+        out.raw('}');
+    }
+
+    TextEscape parseEscape() const {
+        if (parseMode == nullptr)
+            return EscapeNone;
+        return strcmp(parseMode, "HTML") == 0 ? EscapeHTML : EscapeMarkdownV2;
+    }
+};
+
+struct UpdatesBody {
+    uint8_t     limit;
+    uint8_t     timeout;
+    int32_t     offset;         // 0 for none
+
+    void write(JsonWriter &out) const {
+        out.raw("{\"limit\":");
+        out.number(limit);
+        // polling timeout: zero for short polling
+        out.raw(",\"timeout\":");
+        out.number(timeout);
+        out.raw(",\"allowed_updates\":\"message,callback_query\"");
+        if (offset != 0) {
+            out.raw(",\"offset\":");
+            out.number(offset);
+        }
+        out.raw('}');
+    }
+};
+
+struct WebhookBody {
+    const char* url;
+    const char* secret;         // nullptr for none
+
+    void write(JsonWriter &out) const {
+        out.raw("{\"url\":");
+        out.quoted(url);
+        out.raw(",\"allowed_updates\":[\"message\",\"callback_query\"]");
+        if (secret != nullptr && *secret != '\0') {
+            out.raw(",\"secret_token\":");
+            out.quoted(secret);
+        }
+        out.raw('}');
+    }
+};
+
+struct MarkupBody {
+    int64_t     chatId;
+    int32_t     messageId;
+    bool        markdown;
+    const char* keyboard;
+    const KeyboardLayout* layout;
+
+    void write(JsonWriter &out) const {
+        out.raw("{\"chat_id\":");
+        out.number(chatId);
+        out.raw(",\"message_id\":");
+        out.number(messageId);
+        if (markdown)
+            out.raw(",\"parse_mode\":\"Markdown\"");
+        if (layout != nullptr) {
+            out.raw(",\"reply_markup\":");
+            layout->appendJSON(out);
+        }
+        else if (keyboard != nullptr && *keyboard != '\0') {
+            out.raw(",\"reply_markup\":");
+            out.object(keyboard);
+        }
+        out.raw('}');
+    }
+};
+
+#if defined(ESP32)
+// Exclusive use of telegramClient (shared with httpPostTask) while the object is alive
+class ClientLock
+{
+public:
+    ClientLock(SemaphoreHandle_t mutex) : m_mutex(mutex) { xSemaphoreTake(m_mutex, portMAX_DELAY); }
+    ~ClientLock() { xSemaphoreGive(m_mutex); }
+private:
+    SemaphoreHandle_t m_mutex;
+};
+#define LOCK_CLIENT()   ClientLock clientLock(m_clientMutex)
+#else
+#define LOCK_CLIENT()
 #endif
 
 // get fingerprints from https://www.grc.com/fingerprints.htm
 uint8_t default_fingerprint[20] = { 0xF2, 0xAD, 0x29, 0x9C, 0x34, 0x48, 0xDD, 0x8D, 0xF4, 0xCF, 0x52, 0x32, 0xF6, 0x57, 0x33, 0x68, 0x2E, 0x81, 0xC1, 0x90 };
 
-AsyncTelegram::AsyncTelegram() {
+AsyncTelegram::AsyncTelegram() : m_updatesDoc(UPDATES_DOC_SIZE, ArenaAllocator(&m_arena)) {
     telegramServerIP.fromString(TELEGRAM_IP);
-    httpData.payload.reserve(BUFFER_BIG);
-    httpData.param.reserve(512);
-    httpData.command.reserve(32);
+    deserializeJson(m_updatesFilter, (const __FlashStringHelper*) updatesFilter);
+#if defined(ESP32)
+    m_clientMutex = xSemaphoreCreateMutex();
+#endif
     m_minUpdateTime = MIN_UPDATE_TIME;
 #if defined(ESP8266)
     m_session = new BearSSL::Session;
@@ -51,45 +304,237 @@ void AsyncTelegram::setClock(const char* TZ)
 
 bool AsyncTelegram::begin(){
 
-  // Check NTP time, set default if not (Rome, Italy)
-  time_t now = time(nullptr);
-  if (now < 8 * 3600 * 2) 
-    setClock("CET-1CEST,M3.5.0,M10.5.0/3");  
+    // Bot identity from a previous run (if enabled)
+    bool cached = loadStartupCache();
+
+    // Check NTP time, set default if not (Rome, Italy). Time is not needed without certificate validation
+    time_t now = time(nullptr);
+    if (now < 8 * 3600 * 2 && !(cached && m_insecure))
+        setClock("CET-1CEST,M3.5.0,M10.5.0/3");
+
+    setupClient();
+    m_state = BotReady;
+    if (cached)
+        return checkConnection();
+
+    checkConnection();
+    if (!getMe(m_user))
+        return false;
+    setIdentity(m_user.id, m_user.username, m_user.firstName);
+    return true;
+}
+
+
+void AsyncTelegram::beginAsync(){
+    m_identified = loadStartupCache();
+    setupClient();
+
+    m_stateTime = millis() - STARTUP_RETRY_TIME;     // connect without waiting
+    time_t now = time(nullptr);
+    if (now < 8 * 3600 * 2 && !(m_identified && m_insecure)) {
+        // Start NTP sync, time will be checked in startupStep()
+    #ifdef ESP8266
+        configTime("CET-1CEST,M3.5.0,M10.5.0/3", "time.google.com", "time.windows.com", "pool.ntp.org");
+    #elif defined(ESP32)
+        configTzTime("CET-1CEST,M3.5.0,M10.5.0/3", "time.google.com", "time.windows.com", "pool.ntp.org");
+    #endif
+        m_state = BotTimeSync;
+    }
+    else
+        m_state = BotConnect;
+}
+
+
+void AsyncTelegram::startupStep()
+{
+    switch (m_state) {
+        case BotTimeSync:
+            if (time(nullptr) >= 8 * 3600 * 2)
+                m_state = BotConnect;
+            break;
+
+        case BotConnect:
+            if (WiFi.status() != WL_CONNECTED || millis() - m_stateTime < STARTUP_RETRY_TIME)
+                break;
+        #if defined(ESP8266)
+            // On ESP32 the connection is opened by httpPostTask with first request
+            if (!checkConnection()) {
+                m_stateTime = millis();
+                break;
+            }
+        #endif
+            m_stateTime = millis();
+            if (!m_identified)
+                sendCommand("getMe", "");
+            m_state = BotIdentify;
+            break;
+
+        case BotIdentify:
+        #if defined(ESP8266)
+            while (m_pendingCount > 0 && telegramClient->available())
+                readReply();
+        #endif
+            if (m_identified) {
+                m_state = BotReady;
+                if (m_onReady != nullptr)
+                    m_onReady();
+            }
+            else if (millis() - m_stateTime > SERVER_TIMEOUT) {
+                // No reply, connect and ask again
+            #if defined(ESP8266)
+                telegramClient->stop();
+                dropPending();
+            #endif
+                m_state = BotConnect;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void AsyncTelegram::setIdentity(int32_t id, const char* username, const char* firstName)
+{
+    // Keep a copy of the strings (getMe reply is overwritten by next request)
+    m_cache.botId = id;
+    strlcpy(m_cache.username, username != nullptr ? username : "", sizeof(m_cache.username));
+    strlcpy(m_cache.firstName, firstName != nullptr ? firstName : "", sizeof(m_cache.firstName));
+    m_user.id           = id;
+    m_user.isBot        = true;
+    m_user.firstName    = m_cache.firstName;
+    m_user.username     = m_cache.username;
+    m_user.lastName     = nullptr;
+    m_user.languageCode = nullptr;
+    userName = m_cache.username;
+}
+
+
+bool AsyncTelegram::loadStartupCache()
+{
+    if (!m_cacheEnabled || !m_cache.load(m_cacheFS, m_cachePath, m_token))
+        return false;
+#if defined(ESP8266)
+    // Resume the TLS session of previous run (abbreviated handshake)
+    if (m_cache.hasSession)
+        memcpy(m_session->getSession(), m_cache.session, sizeof(m_cache.session));
+#endif
+    setIdentity(m_cache.botId, m_cache.username, m_cache.firstName);
+    if (m_lastUpdate == 0)
+        m_lastUpdate = m_cache.lastUpdate;
+    return true;
+}
+
+
+void AsyncTelegram::setupClient()
+{
+    // On reset the same client objects are used again (on ESP32 they're shared with httpPostTask)
+    if (telegramClient == nullptr)
+        telegramClient = createClient();
+    if (m_pollClient == nullptr)
+        m_pollClient = createClient();
+#if defined(ESP32)
+    //Start Task with input parameter set to "this" class (only once, it runs forever)
+    if (taskHandler == nullptr)
+        xTaskCreatePinnedToCore(
+        this->httpPostTask,     //Function to implement the task
+        "httpPostTask",         //Name of the task
+        6500,                   //Stack size in words
+        this,                   //Task input parameter
+        10,                     //Priority of the task
+        &taskHandler,           //Task handle.
+        0                       //Core where the task should run
+    );
+#endif
+}
+
+
+WiFiClient* AsyncTelegram::createClient()
+{
+    // plain TCP only when a local server has been set with setServer()
+    if (!m_serverTLS)
+        return new WiFiClient;
+    WiFiClientSecure* client = new WiFiClientSecure;
+    configureClient(client);
+    return client;
+}
+
+
+void AsyncTelegram::setServer(const char* host, uint16_t port, bool tls)
+{
+    strncpy(m_host, host, sizeof(m_host) - 1);
+    m_host[sizeof(m_host) - 1] = '\0';
+    m_port = port;
+    m_serverTLS = tls;
+    // an IP address is used as is, otherwise the hostname is resolved on connect
+    if (!telegramServerIP.fromString(m_host))
+        telegramServerIP = IPAddress(0, 0, 0, 0);
+}
+
 
-    telegramClient = new WiFiClientSecure;
-    telegramClient->setTimeout(SERVER_TIMEOUT);
+void AsyncTelegram::configureClient(WiFiClientSecure* client)
+{
+    client->setTimeout(SERVER_TIMEOUT);
 #if defined(ESP8266)
+    // TLS session is resumed when the server closes the connection
+    client->setSession(m_session);
   #if USE_FINGERPRINT
     setFingerprint(default_fingerprint);
-    telegramClient->setFingerprint(m_fingerprint);
+    client->setFingerprint(m_fingerprint);
   #else
-    telegramClient->setBufferSizes(TCP_MSS, TCP_MSS);
-    telegramClient->setSession(m_session);
+    client->setBufferSizes(TCP_MSS, TCP_MSS);
     if(m_insecure)
-        telegramClient->setInsecure();
+        client->setInsecure();
     else
-        telegramClient->setTrustAnchors(m_cert);
+        client->setTrustAnchors(m_cert);
   #endif
 
 #elif defined(ESP32)
     if(m_insecure)
-        telegramClient->setInsecure();
+        client->setInsecure();
     else
-        telegramClient->setCACert(digicert);
-    //Start Task with input parameter set to "this" class
-    xTaskCreatePinnedToCore(
-        this->httpPostTask,     //Function to implement the task
-        "httpPostTask",         //Name of the task
-        6500,                   //Stack size in words
-        this,                   //Task input parameter
-        10,                     //Priority of the task
-        &taskHandler,           //Task handle.
-        0                       //Core where the task should run
-    );
+        client->setCACert(digicert);
 #endif
+}
 
-    checkConnection();
-    return getMe(m_user);
+
+bool AsyncTelegram::saveStartupCache()
+{
+    if (!m_cacheEnabled || m_cache.botId == 0)
+        return false;
+    m_cache.lastUpdate = deliveredUpdate();
+#if defined(ESP8266)
+    m_cache.hasSession = m_session->getSession()->session_id_len > 0;
+    memcpy(m_cache.session, m_session->getSession(), sizeof(m_cache.session));
+#endif
+    return m_cache.save(m_cacheFS, m_cachePath, m_token);
+}
+
+
+TBStats AsyncTelegram::getStats()
+{
+    m_stats.sampleHeap();
+    TBStats stats = m_stats.get();
+    stats.handshakes = m_handshakes;
+    stats.arena = m_arena.stats();
+#if defined(ESP32)
+    // Oldest requests discarded by QueueDropOldest policy
+    stats.droppedSends += m_requests.dropped();
+#endif
+    return stats;
+}
+
+
+bool AsyncTelegram::enableStatsCommand(int64_t adminId)
+{
+    return m_commands.add("stats", [this, adminId](const TBMessage &msg, const char* args) {
+        if (msg.sender.id != adminId)
+            return;
+        String reply;
+        BotStats::format(getStats(), reply);
+        sendMessage(msg, reply.c_str());
+    });
 }
 
 
@@ -100,274 +545,857 @@ bool AsyncTelegram::reset(void){
         WiFi.reconnect();
     }
     log_debug("Reset connection\n");
-    telegramClient->stop();
-
-    delete telegramClient;
+    {
+        // Close the connection, client object is kept (httpPostTask could be using it)
+        LOCK_CLIENT();
+        telegramClient->stop();
+    }
 
+    // On ESP32 a pending poll is closed by httpPostTask when next getUpdates is sent
     httpData.waitingReply = false;
-    httpData.payload.clear();
-    httpData.command.clear();
+    httpData.replyReady = false;
     httpData.timestamp = millis();
+#if defined(ESP8266)
+    m_pollClient->stop();
+    m_pollPending = false;
+    dropPending();
+#endif
     return begin();
 }
 
 
-void AsyncTelegram::sendCommand(const char* const&  command, const char* const& param)
+template <typename Body>
+bool AsyncTelegram::sendRequest(const char* command, const Body &body, int64_t chatId)
 {
-#if defined(ESP32)
-    if(httpData.waitingReply == false){
-        httpData.waitingReply = true;
-        httpData.command = command;
-        httpData.param = param;
+    // Conversation is active: keep next polling requests short
+    if (m_longPolling && strcmp(command, "getUpdates") != 0)
+        m_pollTimeout = LONG_POLL_MIN;
+
+    JsonWriter counter;
+    body.write(counter);
+
+#if defined(ESP8266)
+    if (chatId == 0) {
+        // Requests without rate limit: headers and body are written straight to the client
+        if (!checkConnection()) {
+            m_stats.countDropped();
+            return false;
+        }
+        BufferedPrint out(*telegramClient);
+        writeRequestHeaders(out, command, counter.length());
+        JsonWriter writer(out);
+        body.write(writer);
+        out.flush();
+        addPending();
+        return true;
     }
+#endif
+
+    // Body is written once in the request String (httpPostTask posts it without copies)
+    TBRequest request;
+    request.command = command;
+    request.param.reserve(counter.length());
+    JsonWriter writer(request.param);
+    body.write(writer);
+    request.chatId = chatId;
+#if defined(ESP32)
+    // A discarded getUpdates will never be answered: polling must not wait for it
+    auto onDrop = [this](TBRequest &dropped) {
+        if (dropped.command == "getUpdates")
+            httpData.waitingReply = false;
+    };
+    if (!m_requests.push(request, m_queuePolicy, SERVER_TIMEOUT, onDrop)) {
 #else
-    postCommand(command, param, false);
+    // Messages are queued in order and sent as soon as the rate limiter allows it (here or
+    // by getUpdates()), so loop() is never blocked. Waiting for a free slot would wait forever
+    if (!m_requests.push(request, m_queuePolicy == QueueBlock ? QueueFail : m_queuePolicy, 0)) {
 #endif
+        log_error("Requests queue full, %s discarded\n", command);
+        m_stats.countDropped();
+        return false;
+    }
+#if defined(ESP8266)
+    sendQueued();
+#endif
+    return true;
+}
+
+
+bool AsyncTelegram::sendCommand(const char* const&  command, const char* const& param, int64_t chatId)
+{
+    RawBody body = { param };
+    return sendRequest(command, body, chatId);
+}
+
+
+void AsyncTelegram::writeRequestHeaders(Print &out, const char* command, size_t length)
+{
+    m_stats.countRequest(command, length);
+    out.print("POST /bot");
+    out.print(m_token);
+    out.print('/');
+    out.print(command);
+    out.print(" HTTP/1.1\r\nHost: ");
+    out.print(m_host);
+    out.print("\r\nConnection: keep-alive\r\nContent-Type: application/json\r\nContent-Length: ");
+    out.print(length);
+    out.print("\r\n\r\n");
 }
 
 
 // Blocking https POST to server (used with ESP8266)
-bool AsyncTelegram::postCommand(const char* const& command, const char* const& param, bool blocking)
+bool AsyncTelegram::postCommand(const char* const& command, const char* const& param, bool blocking,
+                                const JsonDocument* filter)
 {
+    LOCK_CLIENT();
     bool connected = checkConnection();
     if(connected){
-        String request;
-        request.reserve(BUFFER_MEDIUM);
-        request = "POST https://" TELEGRAM_HOST "/bot";
-        request += m_token;
-        request += "/";
-        request += command;
-        request += " HTTP/1.1" "\nHost: api.telegram.org" "\nConnection: keep-alive" "\nContent-Type: application/json";
-        request += "\nContent-Length: ";
-        request += strlen(param);
-        request += "\n\n";
-        request += param;
-        telegramClient->print(request);
-        httpData.waitingReply = true;
-
-         // Blocking mode
+        BufferedPrint out(*telegramClient);
+        writeRequestHeaders(out, command, strlen(param));
+        out.print(param);
+        out.flush();
+
+         // Blocking mode: all pending replies have to be read before
         if (blocking) {
-            while (telegramClient->connected()) {
-                yield();
-                String line = telegramClient->readStringUntil('\n');
-                if (line == "\r") break;
-            }
-            // If there are incoming bytes available from the server, read them and print them:
-            while (telegramClient->available()) {
-                yield();
-                httpData.payload  += (char) telegramClient->read();
-            }
-            httpData.waitingReply = false;
-            DeserializationError error = deserializeJson(smallDoc, httpData.payload);
+    #if defined(ESP8266)
+            while (m_pendingCount > 0 && telegramClient->connected())
+                readReply();
+    #endif
+            int32_t length = waitReplyHeaders();
+            if (length > 0)
+                m_stats.countReply(length);
+            ReplyReader reader(*telegramClient, length);
+            smallDoc.clear();
+            DeserializationError error = filter != nullptr
+                ? deserializeJson(smallDoc, reader, DeserializationOption::Filter(*filter))
+                : deserializeJson(smallDoc, reader);
+            reader.flush();
             return !error;
         }
+
+    #if defined(ESP8266)
+        addPending();
+    #endif
+        return true;
     }
     return false;
 }
 
 
+// Read status line and headers of server reply
+// returns
+//   the reply body length (-1 if unknown)
+int32_t AsyncTelegram::readReplyHeaders(Stream &stream, int16_t* status)
+{
+    int32_t length = -1;
+    char line[64];
+    bool truncated = false;
+    if (status != nullptr)
+        *status = 0;
+    for (bool first = true;; first = false) {
+        size_t len = stream.readBytesUntil('\n', line, sizeof(line) - 1);
+        if (len == 0 && !truncated)
+            break;              // timeout or connection closed
+        line[len] = '\0';
+        // The remaining part of a long header line: skip it
+        if (truncated) {
+            truncated = len == sizeof(line) - 1;
+            continue;
+        }
+        truncated = len == sizeof(line) - 1;
+        if (len <= 1 && (len == 0 || line[0] == '\r'))
+            break;              // empty line: end of headers
+        // Status line: "HTTP/1.1 200 OK"
+        if (first && status != nullptr && strncmp(line, "HTTP/", 5) == 0) {
+            const char* code = strchr(line, ' ');
+            *status = code != nullptr ? atoi(code + 1) : 0;
+        }
+        else if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = atol(line + 15);
+    }
+    return length;
+}
+
+
+int32_t AsyncTelegram::waitReplyHeaders(int16_t* status)
+{
+    uint32_t start = millis();
+    int32_t length = readReplyHeaders(*telegramClient, status);
+    m_stats.addLatency(LatencyFirstByte, millis() - start);
+    return length;
+}
+
+
+// Parse the body of a server reply directly from the stream.
+// getUpdates reply is stored in m_updatesDoc, other replies are just checked
+int16_t AsyncTelegram::parseReply(Stream &stream, int32_t length, bool isUpdate)
+{
+    int16_t result = 0;
+    uint32_t start = millis();
+    ReplyReader reader(stream, length);
+    if (isUpdate) {
+        m_updatesDoc.clear();
+        m_updatesError = deserializeJson(m_updatesDoc, reader, DeserializationOption::Filter(m_updatesFilter));
+        httpData.replyReady = true;
+        if (m_updatesError && m_updatesError != DeserializationError::NoMemory)
+            result = -1;
+    }
+    else {
+        // Temporary documents are taken from the arena (replies are parsed one at a time)
+        ArenaJsonDocument filter(BUFFER_SMALL, ArenaAllocator(&m_arena));
+        filter["ok"] = true;
+        filter["error_code"] = true;
+        filter["description"] = true;
+        filter["parameters"]["retry_after"] = true;
+        bool identify = m_state == BotIdentify && !m_identified;
+        if (identify) {
+            // getMe reply sent by beginAsync()
+            filter["result"]["id"] = true;
+            filter["result"]["username"] = true;
+            filter["result"]["first_name"] = true;
+        }
+        ArenaJsonDocument doc(BUFFER_SMALL, ArenaAllocator(&m_arena));
+        deserializeJson(doc, reader, DeserializationOption::Filter(filter));
+        bool ok = doc["ok"];
+        if (!ok) {
+            result = doc["error_code"].isNull() ? -1 : doc["error_code"].as<int16_t>();
+            errorJson(doc["description"].as<const char*>());
+            // Too Many Requests: stop sending messages for the requested time
+            if (doc["error_code"] == 429)
+                m_rateLimiter.pause(doc["parameters"]["retry_after"].as<uint32_t>() * 1000UL);
+        }
+        else if (identify && doc["result"]["username"]) {
+            setIdentity(doc["result"]["id"], doc["result"]["username"], doc["result"]["first_name"]);
+            m_identified = true;
+        }
+    }
+    reader.flush();
+    httpData.timestamp = millis();
+    m_stats.addLatency(LatencyBody, httpData.timestamp - start);
+    if (length > 0)
+        m_stats.countReply(length);
+    return result;
+}
+
+
+#if defined(ESP8266)
+// Read the next pending reply from server
+void AsyncTelegram::readReply()
+{
+    bool message = m_pendingMessages & 1;
+    m_pendingMessages >>= 1;
+    m_pendingCount--;
+    int16_t error = parseReply(*telegramClient, readReplyHeaders(*telegramClient), false);
+    if (!message)
+        return;
+
+    TBRequest request;
+    m_sentMessages.pop(request);
+    // Too Many Requests: rate limiter has been paused, message is sent again (first) when allowed
+    if (error == 429) {
+        request.resent = true;
+        if (!m_heldRequests.add(request, true))
+            m_stats.countDropped();
+    }
+}
+
+
+void AsyncTelegram::sendQueued()
+{
+    TBRequest request;
+    while (nextRequest(request)) {
+        if (!checkConnection()) {
+            m_stats.countDropped();
+            continue;
+        }
+        BufferedPrint out(*telegramClient);
+        writeRequestHeaders(out, request.command.c_str(), request.param.length());
+        out.print(request.param);
+        out.flush();
+        addPending(&request);
+    }
+}
+
+
+void AsyncTelegram::addPending(TBRequest* message)
+{
+    // Replies will be read in the same order of requests (deadline starts with the oldest one)
+    if (m_pendingCount == 0)
+        m_requestTime = millis();
+    // A message is kept until its reply, so it can be sent again after a 429 error (only once)
+    if (message != nullptr && !message->resent && m_pendingCount < 32
+            && m_sentMessages.push(*message, QueueFail, 0))
+        m_pendingMessages |= 1UL << m_pendingCount;
+    if (m_pendingCount < 0xFF)
+        m_pendingCount++;
+}
+
+
+void AsyncTelegram::dropPending()
+{
+    TBRequest request;
+    while (m_sentMessages.pop(request))
+        ;
+    m_pendingMessages = 0;
+    m_pendingCount = 0;
+}
+#endif
+
+
+bool AsyncTelegram::sendPoll(const char* body, size_t length)
+{
+    // A previous request still pending is abandoned (i.e. after reset())
+    if (m_pollPending) {
+        m_pollClient->stop();
+        m_pollPending = false;
+    }
+    if (!connectClient(m_pollClient))
+        return false;
+
+    BufferedPrint out(*m_pollClient);
+    writeRequestHeaders(out, "getUpdates", length);
+    out.write((const uint8_t*) body, length);
+    out.flush();
+
+    // Reply deadline: server side timeout of this request plus the usual reply time
+    const char* timeout = strstr(body, "\"timeout\":");
+    m_pollDeadline = (timeout != nullptr ? atoi(timeout + 10) * 1000UL : 0) + SERVER_TIMEOUT;
+    m_pollSent = millis();
+    m_pollPending = true;
+    return true;
+}
+
+
+void AsyncTelegram::readPoll()
+{
+    if (!m_pollPending)
+        return;
+
+    if (m_pollClient->available()) {
+        m_pollPending = false;
+        parseReply(*m_pollClient, readReplyHeaders(*m_pollClient), true);
+    }
+    else if (!m_pollClient->connected() || millis() - m_pollSent > m_pollDeadline) {
+        // Connection lost or no reply in time: next request will open a new connection
+        if (m_pollClient->connected()) {
+            log_info("No reply to getUpdates, close polling connection\n");
+            m_stats.countReset();
+        }
+        m_pollClient->stop();
+        m_pollPending = false;
+        httpData.waitingReply = false;
+    }
+    else
+        return;
+#if defined(ESP32)
+    // Wake up handleMessages()
+    m_updatesSignal.give();
+#endif
+}
+
+
+bool AsyncTelegram::nextRequest(TBRequest &request)
+{
+    auto ready = [this](int64_t chatId) { return m_rateLimiter.acquire(chatId) == 0; };
+    if (m_heldRequests.take(request, ready))
+        return true;
+    while (m_requests.pop(request)) {
+        // Messages to a chat are sent in order: after a held one, the next ones are held too
+        if (request.chatId == 0 || (!m_heldRequests.contains(request.chatId) && ready(request.chatId)))
+            return true;
+        if (!m_heldRequests.add(request)) {
+            log_error("Too many messages waiting for rate limit, %s discarded\n", request.command.c_str());
+            m_stats.countDropped();
+        }
+    }
+    return false;
+}
+
 
 void AsyncTelegram::httpPostTask(void *args){
 #if defined(ESP32)
 
-    Serial.print("\nStart http request task on core ");
-    Serial.println(xPortGetCoreID());
+    log_info("Start http request task on core %d\n", xPortGetCoreID());
 
-    bool resetTask = false;
     AsyncTelegram *_this = (AsyncTelegram *) args;
     HTTPClient https;
-    //https.setReuse(true);
+    // Keep the connection open between requests: https.end() closes it only if
+    // the server replied with "Connection: close" (next request will connect again)
+    https.setReuse(true);
+    // Long polling requests don't use this connection
     https.setTimeout(SERVER_TIMEOUT);
 
+    TBRequest request;
     for(;;) {
-        //bool connected = _this->checkConnection();
-        if (_this->httpData.command.length() > 0 &&  WiFi.status()== WL_CONNECTED ) {
-            char url[256];
-            sniprintf(url, 256, "https://%s/bot%s/%s", TELEGRAM_HOST, _this->m_token, _this->httpData.command.c_str() );
-            https.begin(*_this->telegramClient, url);
-            _this->httpData.waitingReply = true;
-            if( _this->httpData.param.length() > 0 ){
-                https.addHeader("Host", TELEGRAM_HOST, false, false);
+        _this->readPoll();
+        // Set before pop(), so pendingRequests() never misses the request being sent
+        _this->m_requestBusy = true;
+        if (WiFi.status()== WL_CONNECTED && _this->nextRequest(request)) {
+            if (request.command == "getUpdates") {
+                // Long poll on its own connection: reply is read by readPoll() while other requests are sent
+                if (!_this->sendPoll(request.param.c_str(), request.param.length())) {
+                    _this->httpData.waitingReply = false;
+                    _this->m_updatesSignal.give();
+                }
+                request.param.clear();
+                _this->m_requestBusy = false;
+                continue;
+            }
+            ClientLock clientLock(_this->m_clientMutex);
+            char uri[128];
+            sniprintf(uri, 128, "/bot%s/%s", _this->m_token, request.command.c_str() );
+            https.begin(*_this->telegramClient, _this->m_host, _this->m_port, uri, _this->m_serverTLS);
+            if( request.param.length() > 0 ){
+                https.addHeader("Host", _this->m_host, false, false);
                 https.addHeader("Connection", "keep-alive", false, false);
                 https.addHeader("Content-Type", "application/json", false, false);
-                https.addHeader("Content-Length", String(_this->httpData.param.length()), false, false );
+                https.addHeader("Content-Length", String(request.param.length()), false, false );
             }
 
-            int httpCode = https.POST(_this->httpData.param);
-            if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY) {
-                // HTTP header has been send and Server response header has been handled
-                _this->httpData.payload  = https.getString();
-                _this->httpData.timestamp = millis();
-
-                if(https.header("Connection").equalsIgnoreCase("close")){
-                    resetTask = true;  // Force reset connection
-                }
+            // Connect here (if needed) to measure the handshake, HTTPClient will reuse the connection
+            _this->checkConnection();
+            _this->m_stats.countRequest(request.command.c_str(), request.param.length());
+            uint32_t sent = millis();
+            int httpCode = https.POST(request.param);
+            if (httpCode > 0)
+                _this->m_stats.addLatency(LatencyFirstByte, millis() - sent);
+            if (httpCode == 429 && request.chatId != 0 && !request.resent) {
+                // Too Many Requests: the reply pauses the rate limiter for the retry_after time,
+                // then the message is sent again (only once, before the other held messages)
+                _this->parseReply(https.getStream(), https.getSize(), false);
+                https.end();
+                request.resent = true;
+                if (!_this->m_heldRequests.add(request, true))
+                    _this->m_stats.countDropped();
+                _this->m_requestBusy = false;
+                delay(1);
+                continue;
+            }
+            if (httpCode > 0) {
+                // HTTP header has been send and Server response header has been handled.
+                // Error replies have a JSON body too (i.e. "Too Many Requests")
+                _this->parseReply(https.getStream(), https.getSize(), false);
             }
             else {
                 log_error("\nHTTPS error: %d\n", httpCode);
-                //resetTask = true;    // Force reset connection
+                _this->m_stats.countDropped();
+                _this->telegramClient->stop();
             }
-            _this->httpData.command.clear();
-            _this->httpData.param.clear();
+            request.param.clear();
             https.end();
 
-            UBaseType_t uxHighWaterMark = uxTaskGetStackHighWaterMark( NULL );
-            //Serial.printf("Task free memory: %5d\n", (uint16_t)uxHighWaterMark);
             log_debug("FreeHeap: %6d, MaxBlock: %6d\n", heap_caps_get_free_size(0), heap_caps_get_largest_free_block(0));
-
-            if (resetTask) {
-                log_debug("\nGoing to delete this task and restart");
-                break;
-            }
         }
+        _this->m_requestBusy = false;
         delay(1);
     }
-	delay(10);
-    _this->httpData.timestamp = 0;  // Force reset on next call
-    vTaskDelete(NULL);
 #endif
 }
 
 
-bool AsyncTelegram::getUpdates(){
-    // No response from Telegram server for a long time
-    if(millis() - httpData.timestamp > 10*m_minUpdateTime) {
-        Serial.println("Reset connection");
-        reset();
-    }
+bool AsyncTelegram::getUpdates(){
+    // Last resort if a poll has been lost without clearing the flag: the longest poll is over
+    if (httpData.waitingReply && millis() - m_lastUpdateTime > LONG_POLL_MAX * 1000UL + 2 * SERVER_TIMEOUT) {
+        log_error("No reply to getUpdates, polling again\n");
+        httpData.waitingReply = false;
+    }
+
+    // With long polling, next request is sent as soon as previous reply has been received.
+    // Otherwise, send message to Telegram server only if enough time has passed since last
+    if(m_longPolling || millis() - m_lastUpdateTime > m_minUpdateTime){
+
+        // If previuos reply from server was received
+        if( httpData.waitingReply == false) {
+            m_lastUpdateTime = millis();
+            UpdatesBody body = { m_updatesLimit, m_pollTimeout, m_lastUpdate };
+        #if defined(ESP32)
+            // Set flag before queueing: httpPostTask clears it if the request fails, even before
+            // sendRequest() returns. Only a request that was never queued clears it here
+            httpData.waitingReply = true;
+            if (!sendRequest("getUpdates", body))
+                httpData.waitingReply = false;
+        #else
+            char param[128];
+            BufferWriter buffer((uint8_t*) param, sizeof(param));
+            JsonWriter writer(buffer);
+            body.write(writer);
+            httpData.waitingReply = sendPoll(param, writer.length());
+        #endif
+        }
+    }
+
+    #if defined(ESP8266)
+    // Messages held by the rate limiter
+    sendQueued();
+    readPoll();
+
+    // If there are incoming bytes available from the server, parse the replies in order
+    while (m_pendingCount > 0 && telegramClient->available())
+        readReply();
+
+    // Connection closed or no reply in time: pending replies are lost
+    if (m_pendingCount > 0 && ((!telegramClient->connected() && !telegramClient->available())
+                               || millis() - m_requestTime > SERVER_TIMEOUT)) {
+        telegramClient->stop();
+        dropPending();
+    }
+    #endif
+    return httpData.replyReady;
+}
+
+
+
+void AsyncTelegram::setUpdatesLimit(uint8_t limit)
+{
+    if (limit == 0)
+        limit = 1;
+    m_updatesLimit = limit > UPDATES_QUEUE_SIZE ? UPDATES_QUEUE_SIZE : limit;
+}
+
+
+// Get first message from queue. Ask server for new updates only if queue is empty
+MessageType AsyncTelegram::getNewMessage(TBMessage &message )
+{
+    message.messageType = MessageNoData;
+    if (m_state != BotReady) {
+        startupStep();
+        return MessageNoData;
+    }
+    if (m_msgCount == 0) {
+        if (m_webhookServer != nullptr) {
+            if (!readWebhook())
+                return MessageNoData;
+        }
+        // We have a reply, parse data received
+        else if( !getUpdates() || parseUpdates() == 0)
+            return MessageNoData;   // waiting for reply from server
+    }
+
+    message = m_messages[m_msgHead];
+    m_deliveredUpdate = m_msgOffsets[m_msgHead];
+    m_msgHead = (m_msgHead + 1) % UPDATES_QUEUE_SIZE;
+    m_msgCount--;
+
+    if (message.messageType == MessageText) {
+        if (m_commands.dispatch(message, userName.c_str()))
+            return MessageNoData;
+    }
+    else if (message.messageType == MessageQuery)
+        m_callbacks.invoke(message);
+    else if (message.messageType == MessageDocument)
+        message.document.file_exists = getFile(message.document);
+
+    return message.messageType;
+}
+
+
+// Wait for new messages and pass them to the handlers
+uint8_t AsyncTelegram::handleMessages(uint32_t timeout)
+{
+    uint32_t start = millis();
+    uint8_t handled = 0;
+    TBMessage msg;
+    for (;;) {
+        MessageType type = getNewMessage(msg);
+        if (type != MessageNoData) {
+            MessageHandler &handler = m_handlers[type] ? m_handlers[type] : m_defaultHandler;
+            if (handler)
+                handler(msg);
+            handled++;
+            continue;
+        }
+        // Other messages still queued (last one was a command handled by onCommand())
+        if (m_msgCount > 0)
+            continue;
+        uint32_t elapsed = millis() - start;
+        if (handled > 0 || elapsed >= timeout)
+            return handled;
+        waitForUpdates(timeout - elapsed);
+    }
+}
+
+
+void AsyncTelegram::waitForUpdates(uint32_t timeout)
+{
+    uint32_t wait = 10;     // start-up steps, webhook or reply already received
+    bool polling = m_state == BotReady && m_webhookServer == nullptr;
+    if (polling && httpData.waitingReply && !httpData.replyReady) {
+    #if defined(ESP32)
+        // httpPostTask gives the signal when the reply has been parsed
+        m_updatesSignal.take(timeout);
+        return;
+    #endif
+        // ESP8266: replies are read by getNewMessage(), just let the network stack work
+    }
+    else if (polling && !m_longPolling) {
+        // Next getUpdates request can be sent only after the min update time
+        uint32_t elapsed = millis() - m_lastUpdateTime;
+        wait = elapsed > m_minUpdateTime ? 0 : m_minUpdateTime - elapsed + 1;
+    }
+    delay(wait < timeout ? wait : timeout);
+}
+
+
+bool AsyncTelegram::setWebhook(const char* url, uint16_t port, const char* secret)
+{
+    WebhookBody body = { url, secret };
+    JsonWriter counter;
+    body.write(counter);
+    String param((char *)0);
+    param.reserve(counter.length());
+    JsonWriter writer(param);
+    body.write(writer);
+
+    if (!postCommand("setWebhook", param.c_str(), true) || !smallDoc["ok"].as<bool>()) {
+        errorJson(smallDoc["description"].as<const char*>());
+        return false;
+    }
+
+    // From now on updates are received by the local server
+    if (m_webhookServer != nullptr) {
+        m_webhookServer->stop();
+        delete m_webhookServer;
+    }
+    m_webhookServer = new WiFiServer(port);
+    m_webhookServer->begin();
+    m_webhookSecret = secret != nullptr ? secret : "";
+    return true;
+}
+
+
+bool AsyncTelegram::deleteWebhook()
+{
+    if (!postCommand("deleteWebhook", "{}", true) || !smallDoc["ok"].as<bool>()) {
+        errorJson(smallDoc["description"].as<const char*>());
+        return false;
+    }
+
+    if (m_webhookServer != nullptr) {
+        m_webhookServer->stop();
+        delete m_webhookServer;
+        m_webhookServer = nullptr;
+    }
+    // Polling starts again with a new request
+    httpData.waitingReply = false;
+    httpData.replyReady = false;
+    return true;
+}
+
+
+// Receive a single update from Telegram server (webhook mode)
+bool AsyncTelegram::readWebhook()
+{
+    WiFiClient client = m_webhookServer->available();
+    if (!client)
+        return false;
+    // Request comes from the local proxy: don't block loop() for long
+    client.setTimeout(2000);
+
+    // Request line and headers
+    char line[320];         // secret token can be up to 256 characters
+    int32_t length = -1;
+    bool post = false;
+    bool authorized = m_webhookSecret.length() == 0;
+    bool truncated = false;
+    for (bool first = true;; first = false) {
+        size_t len = client.readBytesUntil('\n', line, sizeof(line) - 1);
+        // The remaining part of a long line: skip it
+        if (truncated) {
+            truncated = len == sizeof(line) - 1;
+            continue;
+        }
+        truncated = len == sizeof(line) - 1;
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        line[len] = '\0';
+        if (len == 0)
+            break;              // empty line (end of headers) or timeout
+        if (truncated && !first)
+            continue;           // too long for any header we need (i.e. an invalid secret token)
+        if (first)
+            post = strncmp(line, "POST ", 5) == 0;
+        else if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = atol(line + 15);
+        else if (strncasecmp(line, "X-Telegram-Bot-Api-Secret-Token:", 32) == 0) {
+            const char* value = line + 32;
+            while (*value == ' ')
+                value++;
+            authorized = m_webhookSecret.equals(value);
+        }
+    }
+
+    if (!post || !authorized || length <= 0) {
+        client.print(authorized ? "HTTP/1.1 400 Bad Request\r\n" : "HTTP/1.1 403 Forbidden\r\n");
+        client.print("Content-Length: 0\r\nConnection: close\r\n\r\n");
+        client.stop();
+        return false;
+    }
+
+    // Body is a single update: same filter of getUpdates result items
+    ReplyReader reader(client, length);
+    m_updatesDoc.clear();
+    DeserializationError error = deserializeJson(m_updatesDoc, reader,
+                                                 DeserializationOption::Filter(m_updatesFilter["result"][0]));
+    reader.flush();
+    client.print("HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    client.stop();
+    m_stats.countReply(length);
+
+    // An update bigger than the document is skipped, never delivered partially (see parseUpdates())
+    if (error == DeserializationError::NoMemory) {
+        log_error("Webhook update too big for UPDATES_DOC_SIZE, skipped\n");
+        m_stats.countSkipped();
+        return false;
+    }
+    if (error) {
+        errorJson(error.c_str());
+        return false;
+    }
+    debugJson(m_updatesDoc, Serial);
+
+    JsonObject update = m_updatesDoc.as<JsonObject>();
+    m_lastUpdate = update["update_id"].as<int32_t>() + 1;
+    uint8_t slot = (m_msgHead + m_msgCount) % UPDATES_QUEUE_SIZE;
+    TBMessage &message = m_messages[slot];
+    message.clear();
+    if (!parseMessage(update, message))
+        return false;
+    m_msgOffsets[slot] = m_lastUpdate;
+    m_msgCount++;
+    return true;
+}
+
+
+// Parse all the updates received from Telegram server
+uint8_t AsyncTelegram::parseUpdates()
+{
+    DeserializationError error = m_updatesError;
+    httpData.replyReady = false;
+    httpData.waitingReply = false;
 
-    // Send message to Telegram server only if enough time has passed since last
-    if(millis() - m_lastUpdateTime > m_minUpdateTime){
-        m_lastUpdateTime = millis();
+    if (error && error != DeserializationError::NoMemory) {
+        errorJson(error.c_str());
+        return 0;
+    }
 
-        // If previuos reply from server was received
-        if( httpData.waitingReply == false) {
-            String param((char *)0);
-            param.reserve(64);
-            DynamicJsonDocument root(BUFFER_SMALL);
-            root["limit"] = 1;
-            // polling timeout: add &timeout=<seconds. zero for short polling.
-            root["timeout"] = 3;
-            root["allowed_updates"] = "message,callback_query";
-            if (m_lastUpdate != 0) {
-                root["offset"] = m_lastUpdate;
-            }
-            serializeJson(root, param);
-            sendCommand("getUpdates", param.c_str());
-        }
+    bool ok = m_updatesDoc["ok"];
+    if (!ok) {
+        errorJson("getUpdates reply not ok");
+        return 0;
     }
+    debugJson(m_updatesDoc, Serial);
 
-    #if defined(ESP8266)
+    JsonArray result = m_updatesDoc["result"];
+    size_t count = result.size();
 
-    // If there are incoming bytes available from the server, read them and store:
-    while (telegramClient->available() ){
-        httpData.payload += (char) telegramClient->read();
+    // Adaptive long polling: short timeout while messages are coming, grow it while bot is idle
+    if (m_longPolling) {
+        if (count > 0)
+            m_pollTimeout = LONG_POLL_MIN;
+        else
+            m_pollTimeout = m_pollTimeout * 2 > LONG_POLL_MAX ? LONG_POLL_MAX : m_pollTimeout * 2;
+    }
+    // Last update could be truncated if the document is full: it will be fetched again with next request.
+    // A single update bigger than the whole document can't be fetched at all: skip it (never deliver it partially)
+    if (error == DeserializationError::NoMemory && count > 0) {
+        count--;
+        if (count == 0 && result[0]["update_id"].as<int32_t>() > 0) {
+            m_lastUpdate = result[0]["update_id"].as<int32_t>() + 1;
+            log_error("Update %ld too big for UPDATES_DOC_SIZE, skipped\n", (long) m_lastUpdate - 1);
+            m_stats.countSkipped();
+        }
     }
 
-    // We have a message, parse data received
-    if(httpData.payload.length() != 0) {
-        httpData.payload = httpData.payload.substring(httpData.payload.indexOf("{\"ok\":"), httpData.payload.length());
-        return true;
+    // Queue is empty: every update before the current offset has been delivered
+    m_deliveredUpdate = m_lastUpdate;
+    m_msgHead = 0;
+    for (size_t i = 0; i < count && m_msgCount < UPDATES_QUEUE_SIZE; i++) {
+        JsonObject update = result[i];
+        uint32_t updateID = update["update_id"];
+        if (updateID == 0)
+            break;
+        m_lastUpdate = updateID + 1;
+
+        uint8_t slot = (m_msgHead + m_msgCount) % UPDATES_QUEUE_SIZE;
+        TBMessage &message = m_messages[slot];
+        message.clear();
+        // Strings are copied into the message: update reply can be discarded
+        if (parseMessage(update, message)) {
+            m_msgOffsets[slot] = m_lastUpdate;
+            m_msgCount++;
+        }
     }
-    #else
-        return ! httpData.waitingReply;
-    #endif
-    return false;
+    return m_msgCount;
 }
 
 
-
-// Parse message received from Telegram server
-MessageType AsyncTelegram::getNewMessage(TBMessage &message )
+// Parse a single update received from Telegram server
+bool AsyncTelegram::parseMessage(JsonObject update, TBMessage &message)
 {
     message.messageType = MessageNoData;
-    getUpdates();
-    // We have a message, parse data received
-    if( httpData.payload.length() > 0 ) {
-
-        DynamicJsonDocument root(BUFFER_BIG);
-        deserializeJson(root, httpData.payload);
-        httpData.payload.clear();
-        httpData.timestamp = millis();
-        httpData.waitingReply = false;
 
-        bool ok = root["ok"];
-        if (!ok) {
-            errorJson(httpData.payload);
-            return MessageNoData;
+    if(update["callback_query"]["id"]){
+        // this is a callback query
+        message.callbackQueryID   = message.store(update["callback_query"]["id"]);
+        message.chatId            = update["callback_query"]["message"]["chat"]["id"];
+        message.sender.id         = update["callback_query"]["from"]["id"];
+        message.sender.username   = message.store(update["callback_query"]["from"]["username"]);
+        message.sender.firstName  = message.store(update["callback_query"]["from"]["first_name"]);
+        message.sender.lastName   = message.store(update["callback_query"]["from"]["last_name"]);
+        message.messageID         = update["callback_query"]["message"]["message_id"];
+        message.date              = update["callback_query"]["message"]["date"];
+        message.chatInstance      = update["callback_query"]["chat_instance"];
+        message.callbackQueryData = message.store(update["callback_query"]["data"]);
+        message.text              = message.store(update["callback_query"]["message"]["text"]);
+        message.messageType       = MessageQuery;
+    }
+    else if(update["message"]["message_id"]){
+        // this is a message
+        message.messageID        = update["message"]["message_id"];
+        message.chatId           = update["message"]["chat"]["id"];
+        message.sender.id        = update["message"]["from"]["id"];
+        message.sender.username  = message.store(update["message"]["from"]["username"]);
+        message.sender.firstName = message.store(update["message"]["from"]["first_name"]);
+        message.sender.lastName  = message.store(update["message"]["from"]["last_name"]);
+        message.group.title      = message.store(update["message"]["chat"]["title"]);
+        message.date             = update["message"]["date"];
+
+        if(update["message"]["location"]){
+            // this is a location message
+            message.location.longitude = update["message"]["location"]["longitude"];
+            message.location.latitude = update["message"]["location"]["latitude"];
+            message.messageType = MessageLocation;
         }
-        uint32_t updateID = root["result"][0]["update_id"];
-        if (updateID == 0){
-            return MessageNoData;
+        else if(update["message"]["contact"]){
+            // this is a contact message
+            message.contact.id          = update["message"]["contact"]["user_id"];
+            message.contact.firstName   = message.store(update["message"]["contact"]["first_name"]);
+            message.contact.lastName    = message.store(update["message"]["contact"]["last_name"]);
+            message.contact.phoneNumber = message.store(update["message"]["contact"]["phone_number"]);
+            message.contact.vCard       = message.store(update["message"]["contact"]["vcard"]);
+            message.messageType = MessageContact;
         }
-        m_lastUpdate = updateID + 1;
-
-        debugJson(root, Serial);
-
-        if(root["result"][0]["callback_query"]["id"]){
-            // this is a callback query
-            message.callbackQueryID   = root["result"][0]["callback_query"]["id"];
-            message.chatId            = root["result"][0]["callback_query"]["message"]["chat"]["id"];
-            message.sender.id         = root["result"][0]["callback_query"]["from"]["id"];
-            message.sender.username   = root["result"][0]["callback_query"]["from"]["username"];
-            message.sender.firstName  = root["result"][0]["callback_query"]["from"]["first_name"];
-            message.sender.lastName   = root["result"][0]["callback_query"]["from"]["last_name"];
-            message.messageID         = root["result"][0]["callback_query"]["message"]["message_id"];
-            message.text              = root["result"][0]["callback_query"]["message"]["text"].as<String>();
-            message.date              = root["result"][0]["callback_query"]["message"]["date"];
-            message.chatInstance      = root["result"][0]["callback_query"]["chat_instance"];
-            message.callbackQueryData = root["result"][0]["callback_query"]["data"];
-            message.messageType       = MessageQuery;
-            m_inlineKeyboard.checkCallback(message);
-        }
-        else if(root["result"][0]["message"]["message_id"]){
-            // this is a message
-            message.messageID        = root["result"][0]["message"]["message_id"];
-            message.chatId           = root["result"][0]["message"]["chat"]["id"];
-            message.sender.id        = root["result"][0]["message"]["from"]["id"];
-            message.sender.username  = root["result"][0]["message"]["from"]["username"];
-            message.sender.firstName = root["result"][0]["message"]["from"]["first_name"];
-            message.sender.lastName  = root["result"][0]["message"]["from"]["last_name"];
-            message.group.title      = root["result"][0]["message"]["chat"]["title"];
-            message.date             = root["result"][0]["message"]["date"];
-
-            if(root["result"][0]["message"]["location"]){
-                // this is a location message
-                message.location.longitude = root["result"][0]["message"]["location"]["longitude"];
-                message.location.latitude = root["result"][0]["message"]["location"]["latitude"];
-                message.messageType = MessageLocation;
-            }
-            else if(root["result"][0]["message"]["contact"]){
-                // this is a contact message
-                message.contact.id          = root["result"][0]["message"]["contact"]["user_id"];
-                message.contact.firstName   = root["result"][0]["message"]["contact"]["first_name"];
-                message.contact.lastName    = root["result"][0]["message"]["contact"]["last_name"];
-                message.contact.phoneNumber = root["result"][0]["message"]["contact"]["phone_number"];
-                message.contact.vCard       = root["result"][0]["message"]["contact"]["vcard"];
-                message.messageType = MessageContact;
-            }
-            else if(root["result"][0]["message"]["document"]){
-                // this is a document message
-                message.document.file_id      = root["result"][0]["message"]["document"]["file_id"];
-                message.document.file_name    = root["result"][0]["message"]["document"]["file_name"];
-                message.text                  = root["result"][0]["message"]["caption"].as<String>();
-                message.document.file_exists  = getFile(message.document);
-                message.messageType           = MessageDocument;
-            }
-            else if(root["result"][0]["message"]["reply_to_message"]){
-                // this is a reply to message
-                message.text        = root["result"][0]["message"]["text"].as<String>();
-                message.messageType = MessageReply;
-            }
-            else if (root["result"][0]["message"]["text"]) {
-                // this is a text message
-                message.text        = root["result"][0]["message"]["text"].as<String>();
-                message.messageType = MessageText;
-            }
+        else if(update["message"]["document"]){
+            // this is a document message (file link will be requested when message is read)
+            message.document.file_id      = message.store(update["message"]["document"]["file_id"]);
+            message.document.file_name    = message.store(update["message"]["document"]["file_name"]);
+            message.text                  = message.store(update["message"]["caption"]);
+            message.messageType           = MessageDocument;
+        }
+        else if(update["message"]["reply_to_message"]){
+            // this is a reply to message
+            message.text        = message.store(update["message"]["text"]);
+            message.messageType = MessageReply;
+        }
+        else if (update["message"]["text"]) {
+            // this is a text message
+            message.text        = message.store(update["message"]["text"]);
+            message.messageType = MessageText;
         }
-        return message.messageType;
     }
-    return MessageNoData;   // waiting for reply from server
+    if (m_UTF8Encoding)
+        message.decodeText();
+    return message.messageType != MessageNoData;
 }
 
 
@@ -380,11 +1408,10 @@ bool AsyncTelegram::getMe(TBUser &user)
 
     bool ok = smallDoc["ok"];
     if (!ok) {
-        errorJson(httpData.payload);
+        errorJson(smallDoc["description"].as<const char*>());
         return MessageNoData;
     }
     debugJson(smallDoc, Serial);
-    httpData.payload.clear();
     httpData.timestamp = millis();
 
     user.id           = smallDoc["result"]["id"];
@@ -402,112 +1429,471 @@ bool AsyncTelegram::getMe(TBUser &user)
 bool AsyncTelegram::getFile(TBDocument &doc)
 {
     // getFile has to be blocking (wait server reply)
-    char cmd[128];
-    strcpy(cmd,  "getFile?file_id=");
-    strcat(cmd, doc.file_id);
+    String param((char *)0);
+    JsonWriter writer(param);
+    writer.raw("{\"file_id\":");
+    writer.quoted(doc.file_id != nullptr ? doc.file_id : "");
+    writer.raw('}');
 
-    if (!postCommand(cmd, "", true))
+    if (!postCommand("getFile", param.c_str(), true))
        return false;
 
     bool ok = smallDoc["ok"];
     if (!ok) {
-        errorJson(httpData.payload);
-        return MessageNoData;
+        errorJson(smallDoc["description"].as<const char*>());
+        return false;
     }
     debugJson(smallDoc, Serial);
-    httpData.payload.clear();
     httpData.timestamp = millis();
-    strcpy(doc.file_path, "https://api.telegram.org/file/bot" );
-    strcat(doc.file_path, m_token);
-    strcat(doc.file_path, "/");
-    strcat(doc.file_path, smallDoc["result"]["file_path"]);
+    size_t len = snprintf(doc.file_path, sizeof(doc.file_path), "%s://%s/file/bot%s/%s",
+                          m_serverTLS ? "https" : "http", m_host, m_token, smallDoc["result"]["file_path"].as<const char*>());
+    if (len >= sizeof(doc.file_path)) {
+        log_error("File link too long (%u bytes), increase TBDOCUMENT_PATH_SIZE\n", len);
+        doc.file_path[0] = '\0';
+        return false;
+    }
     doc.file_size  = smallDoc["result"]["file_size"].as<long>();
     return true;
 }
 
 
+bool AsyncTelegram::downloadFile(const TBDocument &doc, Print &out, size_t offset)
+{
+    // Link is https://<host>/file/bot<token>/<path>: request only the path on our connection
+    const char* uri = strstr(doc.file_path, "/file/bot");
+    if (uri == nullptr || doc.file_size <= 0)
+        return false;
+    size_t total = doc.file_size;
+    if (offset >= total)
+        return true;
+
+    uint8_t* buffer = (uint8_t*) malloc(BLOCK_SIZE);
+    if (buffer == nullptr) {
+        log_error("Not enough memory for download buffer\n");
+        return false;
+    }
+
+    LOCK_CLIENT();
+    size_t received = offset;
+    bool writeError = false;
+    for (uint8_t attempt = 0; attempt <= DOWNLOAD_RETRIES && received < total && !writeError; attempt++) {
+        if (attempt > 0)
+            log_info("Download interrupted, resume from %u\n", received);
+        if (!checkConnection())
+            continue;
+    #if defined(ESP8266)
+        // Replies of pending requests come first
+        while (m_pendingCount > 0 && telegramClient->connected())
+            readReply();
+    #endif
+        {
+            BufferedPrint request(*telegramClient);
+            request.print("GET ");
+            request.print(uri);
+            request.print(" HTTP/1.1\r\nHost: ");
+            request.print(m_host);
+            request.print("\r\nConnection: keep-alive\r\n");
+            if (received > 0) {
+                request.print("Range: bytes=");
+                request.print(received);
+                request.print("-\r\n");
+            }
+            request.print("\r\n");
+        }
+        m_stats.countRequest("downloadFile", 0);
+
+        int16_t status;
+        int32_t length = waitReplyHeaders(&status);
+        if (status == 0) {
+            // No reply: try again on a new connection
+            telegramClient->stop();
+            continue;
+        }
+        if (status != 200 && status != 206) {
+            log_error("Download failed, HTTP status %d\n", status);
+            ReplyReader reader(*telegramClient, length);
+            reader.flush();
+            break;
+        }
+        // Range not supported by server: whole content is sent again, skip what we already have
+        size_t skip = status == 200 ? received : 0;
+        size_t left = length > 0 ? length : total - received + skip;
+
+        while (left > 0) {
+            size_t len = telegramClient->readBytes(buffer, left < BLOCK_SIZE ? left : BLOCK_SIZE);
+            if (len == 0)
+                break;              // timeout or connection lost
+            left -= len;
+            m_stats.countReply(len);
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            size_t valid = len - skip;
+            if (out.write(buffer + skip, valid) != valid) {
+                log_error("Download aborted, write error after %u bytes\n", received);
+                writeError = true;
+                break;
+            }
+            skip = 0;
+            received += valid;
+            if (m_downloadProgress)
+                m_downloadProgress(received, total);
+            yield();
+        }
+        // Body not completely read: connection can't be used anymore
+        if (left > 0)
+            telegramClient->stop();
+    }
+    free(buffer);
+    return received >= total;
+}
+
 
-void AsyncTelegram::sendMessage(const TBMessage &msg, const char* message, String keyboard)
+bool AsyncTelegram::downloadFile(const TBDocument &doc, fs::FS &fs, const char* path)
 {
-    if (strlen(message) == 0)
-        return;
+    // An existing file is completed (interrupted download)
+    size_t offset = 0;
+    if (fs.exists(path)) {
+        File file = fs.open(path, "r");
+        offset = file.size();
+        file.close();
+        if (offset > (size_t) doc.file_size)
+            offset = 0;
+    }
+    File file = fs.open(path, offset > 0 ? "a" : "w");
+    if (!file) {
+        log_error("Failed to open file %s\n", path);
+        return false;
+    }
+    bool ok = downloadFile(doc, file, offset);
+    file.close();
+    return ok;
+}
 
-    DynamicJsonDocument root(BUFFER_BIG);
-	// Backward compatibility
-	root["chat_id"] = msg.sender.id != 0 ? msg.sender.id : msg.chatId;
-    root["text"] = message;
 
-    if(msg.isMarkdownEnabled)
-        root["parse_mode"] = "MarkdownV2";
+bool AsyncTelegram::downloadFile(const TBDocument &doc, uint8_t* buffer, size_t size)
+{
+    if (buffer == nullptr || size < (size_t) doc.file_size)
+        return false;
+    BufferWriter writer(buffer, size);
+    return downloadFile(doc, writer);
+}
+
+
+// Write a firmware image to flash with Update, computing its SHA-256 while it is received.
+// The last block is kept until finish(): if the image is not the expected one, it is never
+// written, so Update.end() finds the image incomplete and doesn't activate it.
+// On ESP32 blocks are written by a second task (double buffering), so flash writes overlap the download
+class FirmwareWriter : public Print
+{
+public:
+    FirmwareWriter(bool sha256) : m_sha256(sha256) {
+        if (m_sha256) {
+        #if defined(ESP32)
+            mbedtls_sha256_init(&m_hash);
+            mbedtls_sha256_starts(&m_hash, 0);
+        #else
+            br_sha256_init(&m_hash);
+        #endif
+        }
+    }
+
+    ~FirmwareWriter() {
+    #if defined(ESP32)
+        m_pipe.end();
+        if (m_sha256)
+            mbedtls_sha256_free(&m_hash);
+    #else
+        free(m_buffer);
+    #endif
+    }
+
+    // allocate buffers (and start the writer task on ESP32)
+    bool begin() {
+    #if defined(ESP32)
+        if (!m_pipe.begin("flashWriter", false, flashWriter, this))
+            return false;
+        m_current = m_pipe.acquire();
+        m_buffer = m_pipe.buffer(m_current);
+    #else
+        m_buffer = (uint8_t*) malloc(BLOCK_SIZE);
+    #endif
+        return m_buffer != nullptr;
+    }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+
+    size_t write(const uint8_t *data, size_t size) override {
+        if (m_error)
+            return 0;
+        if (m_sha256) {
+        #if defined(ESP32)
+            mbedtls_sha256_update(&m_hash, data, size);
+        #else
+            br_sha256_update(&m_hash, data, size);
+        #endif
+        }
+        size_t done = 0;
+        while (done < size) {
+            // A full block is written only when more data comes
+            if (m_length == BLOCK_SIZE && !flushBlock())
+                return 0;
+            size_t len = size - done < BLOCK_SIZE - m_length ? size - done : BLOCK_SIZE - m_length;
+            memcpy(m_buffer + m_length, data + done, len);
+            m_length += len;
+            done += len;
+        }
+        return size;
+    }
 
-    if(msg.isHTMLenabled)
-        root["parse_mode"] = "HTML";
+    // write the last block if the image has the expected SHA-256 and wait for the flash writes
+    // params
+    //   sha256: the expected digest (32 bytes), nullptr for no check
+    // returns
+    //   true if the whole image has been written
+    bool finish(const uint8_t* sha256) {
+        bool ok = !m_error;
+        if (ok && sha256 != nullptr) {
+            uint8_t digest[32];
+        #if defined(ESP32)
+            mbedtls_sha256_finish(&m_hash, digest);
+        #else
+            br_sha256_out(&m_hash, digest);
+        #endif
+            if (memcmp(digest, sha256, sizeof(digest)) != 0) {
+                log_error("Firmware SHA-256 doesn't match\n");
+                ok = false;
+            }
+        }
+        if (ok && m_length > 0)
+            ok = flushBlock();
+    #if defined(ESP32)
+        m_pipe.end();
+    #endif
+        return ok && !m_error;
+    }
 
-    if(msg.disable_notification)
-        root["disable_notification"] = true;
+private:
+    // hand the current block to the flash writer
+    bool flushBlock() {
+    #if defined(ESP32)
+        m_pipe.submit(m_current, m_length);
+        // Wait until the other buffer has been written
+        m_current = m_pipe.acquire();
+        m_buffer = m_pipe.buffer(m_current);
+    #else
+        writeFlash(m_buffer, m_length);
+    #endif
+        m_length = 0;
+        return !m_error;
+    }
 
-    if (keyboard.length() != 0) {
-        DynamicJsonDocument doc(BUFFER_MEDIUM);
-        deserializeJson(doc, keyboard);
-        JsonObject myKeyb = doc.as<JsonObject>();
-        root["reply_markup"] = myKeyb;
-        if(msg.force_reply) {
-            root["reply_markup"]["selective"] = true,
-            root["reply_markup"]["force_reply"] = true;
+    void writeFlash(uint8_t* data, size_t len) {
+        if (!m_error && Update.write(data, len) != len) {
+            log_error("Flash write failed, Update error %u\n", Update.getError());
+            m_error = true;
         }
     }
 
-    String param;
-    serializeJson(root, param);
-    sendCommand("sendMessage", param.c_str());
-    debugJson(root, Serial);
+#if defined(ESP32)
+    static size_t flashWriter(void* context, uint8_t* buffer, size_t len) {
+        ((FirmwareWriter *) context)->writeFlash(buffer, len);
+        return len;
+    }
+
+    mbedtls_sha256_context m_hash;
+    DoubleBuffer    m_pipe { BLOCK_SIZE };
+    uint8_t         m_current = 0;
+#else
+    br_sha256_context m_hash;
+#endif
+    uint8_t         *m_buffer = nullptr;
+    size_t          m_length = 0;
+    bool            m_sha256;
+    volatile bool   m_error = false;
+};
+
+
+bool AsyncTelegram::updateFirmware(const TBDocument &doc, const char* hash, bool reboot)
+{
+    // MD5 is checked by Update itself, SHA-256 while the image is received
+    size_t hashLength = hash != nullptr ? strlen(hash) : 0;
+    uint8_t sha256[32];
+    if ((hashLength != 0 && hashLength != 32 && hashLength != 64)
+        || (hashLength == 64 && !hexToBytes(hash, sha256, sizeof(sha256)))) {
+        log_error("Firmware hash must be MD5 (32 hex digits) or SHA-256 (64 hex digits)\n");
+        return false;
+    }
+    if (doc.file_size <= 0 || !Update.begin(doc.file_size)) {
+        log_error("Firmware update can't start, Update error %u\n", Update.getError());
+        return false;
+    }
+    if (hashLength == 32)
+        Update.setMD5(hash);
+
+    bool ok;
+    {
+        FirmwareWriter writer(hashLength == 64);
+        ok = writer.begin();
+        if (!ok)
+            log_error("Not enough memory for firmware buffers\n");
+        ok = ok && downloadFile(doc, writer);
+        ok = writer.finish(hashLength == 64 ? sha256 : nullptr) && ok;
+    }
+
+    // An incomplete image is discarded by end()
+    if (!Update.end() || !ok) {
+        log_error("Firmware update failed, Update error %u\n", Update.getError());
+        return false;
+    }
+    log_info("Firmware update done (%ld bytes)\n", (long) doc.file_size);
+    commitUpdates();
+    saveStartupCache();
+    if (reboot) {
+        delay(100);
+        ESP.restart();
+    }
+    return true;
+}
+
+
+bool AsyncTelegram::commitUpdates()
+{
+    // With webhook, updates are confirmed by the reply to each request
+    if (m_webhookServer != nullptr)
+        return true;
+    // Server forgets all the updates before the offset (limit 1: reply is small, nothing new is confirmed).
+    // Messages still queued will be fetched again after a reboot
+    char param[64];
+    snprintf(param, sizeof(param), "{\"offset\":%ld,\"limit\":1,\"timeout\":0}", (long) deliveredUpdate());
+    // Reply could be bigger than smallDoc (a new update): only "ok" is needed
+    StaticJsonDocument<32> filter;
+    filter["ok"] = true;
+    if (!postCommand("getUpdates", param, true, &filter))
+        return false;
+    return smallDoc["ok"].as<bool>();
+}
+
+
+
+bool AsyncTelegram::sendTextMessage(const TBMessage &msg, const char* message, const char* keyboard, const KeyboardLayout* layout,
+                                    const char* const* args, size_t argsCount)
+{
+    if (strlen(message) == 0)
+        return false;
+
+    MessageBody body;
+	// Backward compatibility
+    body.chatId = msg.sender.id != 0 ? msg.sender.id : msg.chatId;
+    body.channel = nullptr;
+    body.text = message;
+    body.parseMode = msg.isHTMLenabled ? "HTML" : (msg.isMarkdownEnabled ? "MarkdownV2" : nullptr);
+    body.silent = msg.disable_notification;
+    body.forceReply = msg.force_reply;
+    body.keyboard = keyboard;
+    body.layout = layout;
+    body.args = args;
+    body.argsCount = argsCount;
+    return sendRequest("sendMessage", body, body.chatId);
 }
 
 
-void AsyncTelegram::sendTo(const int32_t userid, String &message, String keyboard) {
+bool AsyncTelegram::sendTo(const int32_t userid, const char* message, String keyboard) {
     TBMessage msg;
     msg.chatId = userid;
-    return sendMessage(msg, message.c_str(), "");
+    return sendMessage(msg, message, keyboard);
+}
+
+
+size_t AsyncTelegram::broadcast(const int64_t* ids, size_t count, const char* message, const String& keyboard, bool* results)
+{
+    if (ids == nullptr || count == 0 || strlen(message) == 0)
+        return 0;
+
+    // Body template with a dummy chat_id, written once for all recipients
+    String body((char *)0);
+    MessageBody request = { 0, nullptr, message, nullptr, false, false, keyboard.c_str(), nullptr };
+    {
+        JsonWriter counter;
+        request.write(counter);
+        body.reserve(counter.length());
+        JsonWriter out(body);
+        request.write(out);
+    }
+    // Each request body is: {"chat_id":<id>  +  template after the dummy chat_id
+    const size_t dummyLength = 12;      // {"chat_id":0
+    const char* tail = body.c_str() + dummyLength;
+    size_t tailLength = body.length() - dummyLength;
+
+    LOCK_CLIENT();
+    size_t delivered = 0;
+    for (size_t i = 0; i < count; i++) {
+        int16_t error = -1;
+        for (uint8_t attempt = 0; attempt < 2; attempt++) {
+            // Blocking function: wait here for a free slot within Telegram limits
+            for (uint32_t ms; (ms = m_rateLimiter.acquire(ids[i])) > 0; )
+                delay(ms > 100 ? 100 : ms);
+            if (!checkConnection())
+                break;
+        #if defined(ESP8266)
+            // Reply is read immediately: all pending replies have to be read before
+            while (m_pendingCount > 0 && telegramClient->connected())
+                readReply();
+        #endif
+            char head[36] = "{\"chat_id\":";
+            size_t headLength = 11;
+            headLength += int64ToChars(ids[i], head + headLength);
+
+            BufferedPrint out(*telegramClient);
+            writeRequestHeaders(out, "sendMessage", headLength + tailLength);
+            out.write((const uint8_t*) head, headLength);
+            out.write((const uint8_t*) tail, tailLength);
+            out.flush();
+
+            error = parseReply(*telegramClient, waitReplyHeaders(), false);
+            // Too Many Requests: rate limiter has been paused, try again once
+            if (error != 429)
+                break;
+        }
+        if (results != nullptr)
+            results[i] = error == 0;
+        if (error == 0)
+            delivered++;
+    }
+    return delivered;
 }
 
 
-void AsyncTelegram::sendPhotoByUrl(const uint32_t& chat_id,  const String& url, const String& caption)
+bool AsyncTelegram::sendPhotoByUrl(const uint32_t& chat_id,  const String& url, const String& caption)
 {
     if (url.length() == 0)
-        return;
-	smallDoc.clear();
+        return false;
+    smallDoc.clear();
     smallDoc["chat_id"] = chat_id;
     smallDoc["photo"] = url;
     smallDoc["caption"] = caption;
 
     char param[256];
     serializeJson(smallDoc, param, 256);
-    sendCommand("sendPhoto", param);
     debugJson(smallDoc, Serial);
+    return sendCommand("sendPhoto", param, chat_id);
 }
 
 
-void AsyncTelegram::sendToChannel(const char* &channel, String &message, bool silent) {
+bool AsyncTelegram::sendToChannel(const char* &channel, String &message, bool silent) {
     if (message.length() == 0)
-        return;
-    DynamicJsonDocument root(BUFFER_MEDIUM);
-    root["chat_id"] = channel;
-    root["text"] = message;
-    if(silent)
-        root["silent"] = true;
-
-    String param;
-    serializeJson(root, param);
-    sendCommand("sendMessage", param.c_str());
-    debugJson(root, Serial);
+        return false;
+    MessageBody body = { 0, channel, message.c_str(), nullptr, silent, false, nullptr, nullptr };
+    return sendRequest("sendMessage", body, RateLimiter::channelId(channel));
 }
 
 
-void AsyncTelegram::endQuery(const TBMessage &msg, const char* message, bool alertMode)
+bool AsyncTelegram::endQuery(const TBMessage &msg, const char* message, bool alertMode)
 {
     if (strlen(msg.callbackQueryID) == 0)
-        return;
-	smallDoc.clear();
+        return false;
+    smallDoc.clear();
     smallDoc["callback_query_id"] =  msg.callbackQueryID;
     if (strlen(message) != 0) {
         smallDoc["text"] = message;
@@ -518,11 +1904,11 @@ void AsyncTelegram::endQuery(const TBMessage &msg, const char* message, bool ale
     }
     char param[BUFFER_SMALL];
     serializeJson(smallDoc, param, BUFFER_SMALL);
-    sendCommand("answerCallbackQuery", param);
+    return sendCommand("answerCallbackQuery", param);
 }
 
 
-void AsyncTelegram::removeReplyKeyboard(const TBMessage &msg, const char* message, bool selective)
+bool AsyncTelegram::removeReplyKeyboard(const TBMessage &msg, const char* message, bool selective)
 {
 	smallDoc.clear();
     smallDoc["remove_keyboard"] = true;
@@ -531,40 +1917,20 @@ void AsyncTelegram::removeReplyKeyboard(const TBMessage &msg, const char* messag
     }
     char command[128];
     serializeJson(smallDoc, command, 128);
-    sendMessage(msg, message, command);
+    return sendMessage(msg, message, command);
 }
 
-void AsyncTelegram::editMessageReplyMarkup(TBMessage &msg, String keyboard) // keyboard value defaulted to ""
+bool AsyncTelegram::editMessageReplyMarkup(TBMessage &msg, String keyboard) // keyboard value defaulted to ""
 {
-    if (sizeof(msg) == 0)
-        return;
-
-
-    DynamicJsonDocument root(BUFFER_SMALL);
-
-    root["chat_id"] = msg.chatId;
-    root["message_id"] = msg.messageID;
-
-    if (msg.isMarkdownEnabled)
-        root["parse_mode"] = "Markdown";
-
-    if (keyboard.length() != 0) {
-        DynamicJsonDocument doc(512);
-        deserializeJson(doc, keyboard);
-        JsonObject myKeyb = doc.as<JsonObject>();
-        root["reply_markup"] = myKeyb;
-    }
-
-    String buffer;
-    serializeJson(root, buffer);
-    sendCommand("editMessageReplyMarkup", buffer.c_str());
-    debugJson(root, Serial);
+    MarkupBody body = { msg.chatId, msg.messageID, msg.isMarkdownEnabled, keyboard.c_str(), nullptr };
+    return sendRequest("editMessageReplyMarkup", body);
 }
 
-void AsyncTelegram::editMessageReplyMarkup(TBMessage &msg, InlineKeyboard &keyboard)
+bool AsyncTelegram::editMessageReplyMarkup(TBMessage &msg, InlineKeyboard &keyboard)
 {
-    m_inlineKeyboard = keyboard;
-    return editMessageReplyMarkup(msg, keyboard.getJSON());
+    m_callbacks.add(keyboard);
+    MarkupBody body = { msg.chatId, msg.messageID, msg.isMarkdownEnabled, nullptr, &keyboard };
+    return sendRequest("editMessageReplyMarkup", body);
 }
 
 
@@ -582,24 +1948,29 @@ bool AsyncTelegram::serverReply(const char* const& replyMsg)
 }
 
 
-bool AsyncTelegram::checkConnection()
+bool AsyncTelegram::connectClient(WiFiClient* client)
 {
     if(WiFi.status() != WL_CONNECTED )
         return false;
 
     // Start connection with Telegramn server (if necessary)
-    if(! telegramClient->connected() ){
+    if(! client->connected() ){
+        uint32_t start = millis();
         // try to connect
-        if (!telegramClient->connect(telegramServerIP, TELEGRAM_PORT)) {            // no way, try to connect with hostname
-            if (!telegramClient->connect(TELEGRAM_HOST, TELEGRAM_PORT))
-                Serial.printf("Unable to connect to Telegram server\n");
-            else {
+        if ((uint32_t)telegramServerIP == 0 || !client->connect(telegramServerIP, m_port)) {   // no way, try to connect with hostname
+            if (!client->connect(m_host, m_port))
+                log_error("Unable to connect to Telegram server\n");
+            else
                 log_debug("\nConnected using Telegram hostname\n");
-			}
         }
         else log_debug("\nConnected using Telegram ip address\n");
+        // Only completed handshakes are counted
+        if (client->connected()) {
+            m_handshakes++;
+            m_stats.addLatency(LatencyConnect, millis() - start);
+        }
     }
-    return telegramClient->connected();
+    return client->connected();
 }
 
 // bool AsyncTelegram::checkConnection(){
@@ -723,73 +2094,312 @@ bool AsyncTelegram::sendPhotoByFile(const uint32_t& chat_id, const String& fileN
     return sendMultipartFormData("sendPhoto", chat_id, fileName, "image/jpeg", "photo", filesystem );
 }
 
-bool AsyncTelegram::sendMultipartFormData( const String& command,  const uint32_t& chat_id, const String& fileName,
-                                           const char* contentType, const char* binaryPropertyName, fs::FS& fs )
+
+bool AsyncTelegram::sendPhotoFromBuffer(const uint32_t& chat_id, const uint8_t* data, size_t size, const char* fileName)
+{
+    return sendMultipartFormData("sendPhoto", chat_id, fileName, "image/jpeg", "photo", data, size);
+}
+
+
+bool AsyncTelegram::sendDocumentFromBuffer(const uint32_t& chat_id, const uint8_t* data, size_t size,
+                                           const char* fileName, const char* contentType)
+{
+    return sendMultipartFormData("sendDocument", chat_id, fileName, contentType, "document", data, size);
+}
+
+
+bool AsyncTelegram::sendPhotoFromStream(const uint32_t& chat_id, Stream& stream, size_t size, const char* fileName)
+{
+    return sendMultipartFormData("sendPhoto", chat_id, fileName, "image/jpeg", "photo", stream, size);
+}
+
+
+bool AsyncTelegram::sendDocumentFromStream(const uint32_t& chat_id, Stream& stream, size_t size,
+                                           const char* fileName, const char* contentType)
 {
+    return sendMultipartFormData("sendDocument", chat_id, fileName, contentType, "document", stream, size);
+}
 
-    #define BOUNDARY            "----WebKitFormBoundary7MA4YWxkTrZu0gW"
-    #define END_BOUNDARY        "\r\n--" BOUNDARY "--\r\n"
 
+#define BOUNDARY            "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+#define END_BOUNDARY        "\r\n--" BOUNDARY "--\r\n"
+
+bool AsyncTelegram::sendMultipartFormData( const String& command,  const uint32_t& chat_id, const String& fileName,
+                                           const char* contentType, const char* binaryPropertyName, fs::FS& fs )
+{
     File myFile = fs.open("/" + fileName, "r");
     if (!myFile) {
         Serial.printf("Failed to open file %s\n", fileName.c_str());
         return false;
     }
+    UploadSource source;
+    source.stream = &myFile;
+    source.file = &myFile;
+    source.size = myFile.size();
+    bool res = sendMultipartFormData(command.c_str(), chat_id, fileName.c_str(), contentType, binaryPropertyName, source);
+    myFile.close();
+    return res;
+}
 
-    if (telegramClient->connected()) {
-        String formData;
-        formData += "--" BOUNDARY;
-        formData += "\r\nContent-disposition: form-data; name=\"chat_id\"\r\n\r\n";
-        formData += String(chat_id);
-        formData += "\r\n--" BOUNDARY;
-        formData += "\r\nContent-disposition: form-data; name=\"";
-        formData += binaryPropertyName;
-        formData += "\"; filename=\"";
-        formData += fileName;
-        formData += "\"\r\nContent-Type: ";
-        formData += contentType;
-        formData += "\r\n\r\n";
-
-        String uri = "POST /bot";
-        uri += m_token;
-        uri += "/";
-        uri += command;
-        uri += " HTTP/1.1";
-        // Send POST request to host
-        telegramClient->println(uri);
-        // Headers
-        telegramClient->println("Host: " TELEGRAM_HOST);
-        telegramClient->print("Content-Length: ");
-        int contentLength = myFile.size() + formData.length() + String(END_BOUNDARY).length();
-        telegramClient->println(String(contentLength));
-        telegramClient->print("Content-Type: multipart/form-data; boundary=");
-        telegramClient->println(BOUNDARY);
-        telegramClient->println();
-        // Body of request
-        telegramClient->print(formData);
-
-        uint8_t buff[BLOCK_SIZE];
-        uint16_t count = 0;
-        while (myFile.available()) {
-            yield();
-            buff[count++] = myFile.read();
-            if (count == BLOCK_SIZE ) {
-                Serial.println(F("Sending binary photo full buffer"));
-                telegramClient->write((const uint8_t *)buff, BLOCK_SIZE);
-                count = 0;
-            }
-        }
-        if (count > 0) {
-            Serial.println(F("Sending binary photo remaining buffer"));
-            telegramClient->write((const uint8_t *)buff, count);
+
+bool AsyncTelegram::sendMultipartFormData( const char* command,  const uint32_t& chat_id, const char* fileName,
+                                           const char* contentType, const char* binaryPropertyName,
+                                           Stream& stream, size_t size )
+{
+    UploadSource source;
+    source.stream = &stream;
+    source.size = size;
+    return sendMultipartFormData(command, chat_id, fileName, contentType, binaryPropertyName, source);
+}
+
+
+bool AsyncTelegram::sendMultipartFormData( const char* command,  const uint32_t& chat_id, const char* fileName,
+                                           const char* contentType, const char* binaryPropertyName,
+                                           const uint8_t* data, size_t size )
+{
+    UploadSource source;
+    source.data = data;
+    source.size = size;
+    return sendMultipartFormData(command, chat_id, fileName, contentType, binaryPropertyName, source);
+}
+
+
+// Upload engine: send the content and wait for server reply.
+// If connection drops, upload restart from a clean state (only if the source can be read again)
+bool AsyncTelegram::sendMultipartFormData( const char* command,  const uint32_t& chat_id, const char* fileName,
+                                           const char* contentType, const char* binaryPropertyName,
+                                           UploadSource& source )
+{
+    char fileId[128] = {0};
+    bool ok = false;
+    LOCK_CLIENT();
+
+    for (uint8_t attempt = 0; attempt <= m_uploadRetries; attempt++) {
+        if (attempt > 0) {
+            telegramClient->stop();
+            if (!source.rewind())
+                break;
+            log_info("Upload failed, retry %d\n", attempt);
         }
 
+        if (!beginMultipartFormData(command, chat_id, fileName, contentType, binaryPropertyName, source.size))
+            continue;
+
+        if (!writeUploadContent(source))
+            continue;
         telegramClient->print(END_BOUNDARY);
-        myFile.close();
+
+        // Reply received: upload completed (successfully or refused by server, no need to retry)
+        int8_t reply = readUploadReply(fileId, sizeof(fileId));
+        if (reply >= 0) {
+            ok = reply > 0;
+            break;
+        }
     }
-    else {
+
+    if (m_uploadDone)
+        m_uploadDone(ok, fileId);
+    return ok;
+}
+
+
+bool AsyncTelegram::beginMultipartFormData( const char* command,  const uint32_t& chat_id, const char* fileName,
+                                            const char* contentType, const char* binaryPropertyName, size_t size )
+{
+    if (!checkConnection()) {
         Serial.println("\nError: client not connected");
         return false;
     }
+
+#if defined(ESP8266)
+    // Upload reply is read immediately: all pending replies have to be read before
+    while (m_pendingCount > 0 && telegramClient->connected())
+        readReply();
+#endif
+
+    String formData;
+    formData.reserve(256);
+    formData += "--" BOUNDARY;
+    formData += "\r\nContent-disposition: form-data; name=\"chat_id\"\r\n\r\n";
+    formData += String(chat_id);
+    formData += "\r\n--" BOUNDARY;
+    formData += "\r\nContent-disposition: form-data; name=\"";
+    formData += binaryPropertyName;
+    formData += "\"; filename=\"";
+    formData += fileName;
+    formData += "\"\r\nContent-Type: ";
+    formData += contentType;
+    formData += "\r\n\r\n";
+
+    // Send POST request to host
+    telegramClient->print("POST /bot");
+    telegramClient->print(m_token);
+    telegramClient->print("/");
+    telegramClient->print(command);
+    telegramClient->println(" HTTP/1.1");
+    // Headers
+    telegramClient->print("Host: ");
+    telegramClient->println(m_host);
+    size_t length = size + formData.length() + strlen(END_BOUNDARY);
+    m_stats.countRequest(command, length);
+    telegramClient->print("Content-Length: ");
+    telegramClient->println(length);
+    telegramClient->print("Content-Type: multipart/form-data; boundary=");
+    telegramClient->println(BOUNDARY);
+    telegramClient->println();
+    // Body of request
+    telegramClient->print(formData);
+    return true;
+}
+
+
+size_t UploadSource::read(uint8_t* buffer, size_t len)
+{
+    if (len > size - offset)
+        len = size - offset;
+    if (data != nullptr)
+        memcpy(buffer, data + offset, len);
+    else
+        len = stream->readBytes((char*) buffer, len);
+    offset += len;
+    return len;
+}
+
+
+bool UploadSource::rewind()
+{
+    offset = 0;
+    if (data != nullptr)
+        return true;
+    // A generic stream can't be read again
+    return file != nullptr && file->seek(0);
+}
+
+
+#if defined(ESP32)
+// Double buffering on ESP32: a reader task fills a buffer while the other one is sent to server
+static size_t uploadReader(void* context, uint8_t* buffer, size_t len)
+{
+    return ((UploadSource *) context)->read(buffer, len);
+}
+#endif
+
+
+// Send the binary content to server (progress callback is called after each block)
+bool AsyncTelegram::writeUploadContent(UploadSource& source)
+{
+    size_t sent = 0;
+
+    // Content is already in memory: write it directly to the socket in BLOCK_SIZE chunks
+    if (source.data != nullptr) {
+        while (sent < source.size) {
+            size_t len = source.size - sent < BLOCK_SIZE ? source.size - sent : BLOCK_SIZE;
+            size_t written = telegramClient->write(source.data + sent, len);
+            if (written == 0) {
+                log_error("Connection lost after %u bytes\n", sent);
+                return false;
+            }
+            sent += written;
+            if (m_uploadProgress)
+                m_uploadProgress(sent, source.size);
+            yield();
+        }
+        return true;
+    }
+
+#if defined(ESP32)
+    DoubleBuffer pipe(BLOCK_SIZE);
+    if (pipe.begin("uploadReader", true, uploadReader, &source)) {
+        for(;;) {
+            DoubleBuffer::Block block = pipe.receive();
+            if (block.len == 0)
+                break;      // reader task has finished
+            if (telegramClient->write(pipe.buffer(block.index), block.len) != block.len) {
+                log_error("Connection lost after %u bytes\n", sent);
+                break;
+            }
+            sent += block.len;
+            if (m_uploadProgress)
+                m_uploadProgress(sent, source.size);
+            pipe.release(block.index);
+        }
+        // Stop the reader task before the pipe is released
+        pipe.end();
+    }
+    else
+        log_error("Not enough memory for upload buffers\n");
+#else
+    uint8_t buff[BLOCK_SIZE];
+    while (sent < source.size) {
+        size_t len = source.read(buff, BLOCK_SIZE);
+        if (len == 0)
+            break;
+        if (telegramClient->write((const uint8_t *)buff, len) != len) {
+            log_error("Connection lost after %u bytes\n", sent);
+            break;
+        }
+        sent += len;
+        if (m_uploadProgress)
+            m_uploadProgress(sent, source.size);
+        yield();
+    }
+#endif
+
+    if (sent != source.size) {
+        // Declared Content-Length can't be respected anymore: connection has to be closed
+        log_error("Upload aborted, %u of %u bytes sent\n", sent, source.size);
+        telegramClient->stop();
+        return false;
+    }
     return true;
 }
+
+
+// Read server reply for an upload and get the file_id assigned by Telegram
+// returns
+//   1 if upload was successful, 0 if server refused the upload, -1 if no reply was received
+int8_t AsyncTelegram::readUploadReply(char* fileId, size_t size)
+{
+    int16_t status = 0;
+    int32_t length = waitReplyHeaders(&status);
+    // Only a missing status line means the upload could be lost: once the server has replied,
+    // result comes from the status code (uploading again would send the file twice)
+    if (status == 0)
+        return -1;
+    int8_t result = status >= 200 && status < 300 ? 1 : 0;
+    if (length <= 0) {
+        // Body without length (or empty): next reply can't be found in the stream
+        telegramClient->stop();
+        return result;
+    }
+    m_stats.countReply(length);
+
+    ArenaJsonDocument filter(BUFFER_SMALL, ArenaAllocator(&m_arena));
+    filter["ok"] = true;
+    filter["description"] = true;
+    filter["result"]["photo"][0]["file_id"] = true;
+    filter["result"]["document"]["file_id"] = true;
+
+    ArenaJsonDocument doc(BUFFER_MEDIUM, ArenaAllocator(&m_arena));
+    ReplyReader reader(*telegramClient, length);
+    DeserializationError error = deserializeJson(doc, reader, DeserializationOption::Filter(filter));
+    reader.flush();
+    if (error) {
+        log_error("Upload reply not parsed: %s\n", error.c_str());
+        return result;
+    }
+
+    bool ok = doc["ok"];
+    if (!ok) {
+        errorJson(doc["description"].as<const char*>());
+        return 0;
+    }
+
+    // Photos are returned in several sizes: last one is the biggest
+    JsonArray photo = doc["result"]["photo"];
+    const char* id = photo.size() ? photo[photo.size() - 1]["file_id"].as<const char*>()
+                                  : doc["result"]["document"]["file_id"].as<const char*>();
+    if (id != nullptr)
+        strlcpy(fileId, id, size);
+    return 1;
+}
@@ -3,6 +3,8 @@
 #define ASYNCTELEGRAM
 
 #include <FS.h>
+#include <functional>
+#include <initializer_list>
 
 // for using int_64 data
 #define ARDUINOJSON_USE_LONG_LONG 	1
@@ -21,7 +23,7 @@
     #error "This library work only with ESP8266 or ESP32"
 #endif
 
-#define DEBUG_ENABLE        1
+// Log level can be chosen with LOG_LEVEL (see serial_log.h), DEBUG_ENABLE 1 is the same as LOG_LEVEL_DEBUG
 #ifndef DEBUG_ENABLE
     #define DEBUG_ENABLE    0
 #endif
@@ -29,22 +31,77 @@
 #define USE_FINGERPRINT     0           // use Telegram fingerprint server validation
 #define SERVER_TIMEOUT      10000
 #define MIN_UPDATE_TIME     500
+#define SHORT_POLL_TIMEOUT  3           // getUpdates server side timeout (s) with fixed time polling
+#define LONG_POLL_MIN       1           // getUpdates server side timeout (s) while a conversation is active
+#define LONG_POLL_MAX       50          // getUpdates server side timeout (s) while bot is idle
+#define UPDATES_FILTER_SIZE 1536        // ArduinoJson filter with the getUpdates fields we are interested in
+#define DOWNLOAD_RETRIES    3           // times an interrupted download is resumed
+#define WEBHOOK_PORT        8080        // default local port of webhook HTTP server
+#define REQUEST_QUEUE_SIZE  8           // max number of outgoing requests waiting to be sent (power of two)
+#define HELD_REQUESTS_SIZE  8           // max number of messages waiting for the rate limiter (next ones are discarded)
 
 #include "DataStructures.h"
+#include "RequestQueue.h"
+#include "JsonArena.h"
+#include "BotStats.h"
 #include "InlineKeyboard.h"
+#include "CallbackRegistry.h"
+#include "CommandRouter.h"
+#include "StartupCache.h"
+#include "RateLimiter.h"
+#include "UpdatesSignal.h"
 #include "ReplyKeyboard.h"
 #include "Utilities.h"
 #include "serial_log.h"
 #include "ca_cert.h"
 
 
+// Default server address (use setServer() to test against a local Bot API server)
+#ifndef TELEGRAM_HOST
 #define TELEGRAM_HOST  "api.telegram.org"
+#endif
+#ifndef TELEGRAM_IP
 #define TELEGRAM_IP    "149.154.167.220"
+#endif
+#ifndef TELEGRAM_PORT
 #define TELEGRAM_PORT   443
+#endif
+
+#define STARTUP_RETRY_TIME  2000          // wait time before retrying a failed connection on start-up
+
+// Start-up steps of beginAsync()
+enum BotState {
+    BotIdle     = 0,    // begin() or beginAsync() not called yet
+    BotTimeSync = 1,    // waiting for NTP time sync
+    BotConnect  = 2,    // connecting to Telegram server
+    BotIdentify = 3,    // waiting for getMe reply
+    BotReady    = 4     // messages can be received
+};
+
+// Source of binary content for multipart uploads: a memory buffer or a stream
+struct UploadSource {
+    const uint8_t*  data = nullptr;     // content already in memory
+    Stream*         stream = nullptr;   // content read from stream
+    File*           file = nullptr;     // set if stream is a File (upload can be restarted)
+    size_t          size = 0;
+    size_t          offset = 0;
+
+    // read next block of content
+    size_t read(uint8_t* buffer, size_t len);
+    // restart from the beginning of content (false if not possible)
+    bool rewind();
+};
+
 
 class AsyncTelegram
 {
 
+using UploadProgressCallback = std::function<void(size_t sent, size_t total)>;
+using UploadDoneCallback = std::function<void(bool ok, const char* fileId)>;
+using DownloadProgressCallback = std::function<void(size_t received, size_t total)>;
+using ReadyCallback = std::function<void()>;
+using MessageHandler = std::function<void(TBMessage &msg)>;
+
 public:
     // default constructor
     AsyncTelegram();
@@ -57,11 +114,40 @@ public:
     bool begin(void);
 
 
+    // start the bot without blocking: NTP time sync, connection and identification (getMe)
+    // are done step by step while getNewMessage() is called from loop().
+    // getNewMessage() returns MessageNoData until the bot is ready
+    // (on ESP8266 the TLS handshake is still blocking)
+    void beginAsync(void);
+
+    // current start-up step (see BotState)
+    inline BotState getState() const { return m_state; }
+
+    // call a function when the bot is ready (from getNewMessage(), after beginAsync())
+    inline void onReady(ReadyCallback onReady) { m_onReady = onReady; }
+
     // reset the connection between ESP8266 and the telegram server (ex. when connection was lost)
     // returns
     //    true if no error occurred
     bool reset(void);
 
+    // keep bot identity, last update offset (and TLS session on ESP8266) for a fast start after
+    // a reboot or a deep sleep: begin() then doesn't wait for getMe reply (and for NTP sync in insecure mode).
+    // Data is stored calling saveStartupCache() (i.e. just before going to deep sleep)
+    // params
+    //   fs  : the filesystem where data is saved (nullptr: RTC memory)
+    //   path: the file name
+    inline void enableStartupCache(fs::FS* fs = nullptr, const char* path = STARTUP_CACHE_FILE) {
+        m_cacheEnabled = true;
+        m_cacheFS = fs;
+        m_cachePath = path;
+    }
+
+    // save startup data (see enableStartupCache())
+    // returns
+    //    true if no error occurred
+    bool saveStartupCache();
+
     // set the telegram token
     // params
     //   token: the telegram token
@@ -89,6 +175,46 @@ public:
     //    pollingTime: interval time in milliseconds
     void setUpdateTime(uint32_t pollingTime) { m_minUpdateTime = pollingTime;}
 
+    // enable/disable the adaptive long polling mode (setUpdateTime() value is ignored).
+    // A new getUpdates request is sent as soon as the previous reply has been received.
+    // Server side timeout grows up to LONG_POLL_MAX seconds while the bot is idle and
+    // drop back to LONG_POLL_MIN when new messages are received or sent.
+    // getUpdates requests always have their own connection (a second TLS client), so a pending
+    // poll never delays messages or blocking requests.
+    // params:
+    //    value: true  -> use adaptive long polling
+    //           false -> poll server every setUpdateTime() milliseconds
+    inline void enableLongPolling(bool value) {
+        m_longPolling = value;
+        m_pollTimeout = value ? LONG_POLL_MIN : SHORT_POLL_TIMEOUT;
+    }
+
+    // set the max number of updates fetched with a single getUpdates request.
+    // All the updates received are parsed and queued, so next calls of getNewMessage()
+    // will not query the server until the queue is empty.
+    // params:
+    //    limit: number of updates for each request (1 - UPDATES_QUEUE_SIZE)
+    void setUpdatesLimit(uint8_t limit);
+
+    // receive updates with a webhook instead of getUpdates polling: Telegram server POSTs each
+    // update to <url> as soon as it arrives and a local HTTP server on <port> accepts it.
+    // Telegram requires HTTPS (ports 443, 80, 88 or 8443), so the url has to point to a reverse
+    // proxy that forwards the requests to the device in plain HTTP.
+    // Updates are read from getNewMessage() / handleMessages() as usual
+    // params
+    //    url    : public HTTPS address of the webhook
+    //    port   : local port of the HTTP server
+    //    secret : sent by Telegram in the "X-Telegram-Bot-Api-Secret-Token" header of each
+    //             request (requests without it are refused), nullptr for none
+    // returns
+    //    true if Telegram server accepted the webhook
+    bool setWebhook(const char* url, uint16_t port = WEBHOOK_PORT, const char* secret = nullptr);
+
+    // remove the webhook and go back to getUpdates polling
+    // returns
+    //    true if Telegram server removed the webhook
+    bool deleteWebhook();
+
     // Get file link and size by unique document ID
     // params
     //   doc   : document structure
@@ -104,11 +230,18 @@ public:
     //          false -> use fixed IP addres
     inline void useDNS(bool value){   m_useDNS = value; }
 
+    // use another Bot API server (i.e. a local server for testing), must be called before begin()
+    // params
+    //   host: hostname or IP address of the server
+    //   port: server port
+    //   tls : false for a plain TCP connection
+    void setServer(const char* host, uint16_t port = TELEGRAM_PORT, bool tls = true);
+
 
     // enable/disable the UTF8 encoding for the received message.
     // Default value is false (disabled)
     // param
-    //   value: true  -> encode the received message with UTF8 encoding rules
+    //   value: true  -> \uXXXX sequences written in the message text are decoded to UTF8 (in place)
     //          false -> leave the received message as-is
     inline void enableUTF8Encoding(bool value) {   m_UTF8Encoding = value;}
 
@@ -120,56 +253,152 @@ public:
     // params
     //   message: the data structure that will contains the data retrieved
     // returns
-    //   MessageNoData: an error has occurred
+    //   MessageNoData: an error has occurred (or the message was a command handled by onCommand())
     //   MessageText  : the received message is a text
     //   MessageQuery : the received message is a query (from inline keyboards)
     MessageType getNewMessage(TBMessage &message);
 
+    // call a function when a "/command" text message is received (from getNewMessage).
+    // "/command@botname" is accepted only if botname is this bot (i.e. in groups).
+    // Handled commands are not returned by getNewMessage()
+    // params
+    //   command: the command name (leading '/' is optional, case insensitive)
+    //   handler: void handler(const TBMessage &msg, const char* args)
+    //            args points to the text after the command (no copy, valid only inside the handler)
+    // returns
+    //   false if there isn't enough space for a new command
+    inline bool onCommand(const char* command, CommandRouter::CommandHandler handler) {
+        return m_commands.add(command, handler);
+    }
+
+    // call a function when a message of the given type is received (see handleMessages())
+    // params
+    //   type   : the message type (MessageText, MessageQuery, ...)
+    //   handler: void handler(TBMessage &msg)
+    inline void onMessage(MessageType type, MessageHandler handler) {
+        if (type <= MessageReply)
+            m_handlers[type] = handler;
+    }
+
+    // call a function for all the message types without a specific handler
+    inline void onMessage(MessageHandler handler) { m_defaultHandler = handler; }
+
+    // call a function when a button of an inline keyboard is pressed
+    inline void onCallbackQuery(MessageHandler handler) { onMessage(MessageQuery, handler); }
+
+    // event-driven alternative to getNewMessage(): wait for new messages and pass them to the
+    // handlers set with onMessage(). On ESP32 the calling task sleeps until httpPostTask
+    // has received the updates, instead of polling
+    // params
+    //   timeout: max waiting time in milliseconds
+    // returns
+    //   the number of messages passed to the handlers
+    uint8_t handleMessages(uint32_t timeout = 1000);
+
     // send a message to the specified telegram user ID
     // params
     //   msg      : the TBMessage telegram recipient with user ID
     //   message : the message to send
     //   keyboard: the inline/reply keyboard (optional)
     //             (in json format or using the inlineKeyboard/ReplyKeyboard class helper)
-    void sendMessage(const TBMessage &msg, const char* message, String keyboard = "");
+    // returns
+    //   true if the request was accepted (sent or queued)
+    inline bool sendMessage(const TBMessage &msg, const char* message, String keyboard = "")
+    {
+        return sendTextMessage(msg, message, keyboard.c_str(), nullptr);
+    }
 
     // sendMessage function overloads
-    inline void sendMessage(const TBMessage &msg, String &message, String keyboard = "")
+    inline bool sendMessage(const TBMessage &msg, String &message, String keyboard = "")
     {
-        return sendMessage(msg, message.c_str(), keyboard);
+        return sendTextMessage(msg, message.c_str(), keyboard.c_str(), nullptr);
     }
 
-    inline void sendMessage(const TBMessage &msg, const char* message, InlineKeyboard &keyboard)
+    // keyboard JSON is written as-is in the request (generated only once)
+    inline bool sendMessage(const TBMessage &msg, const char* message, InlineKeyboard &keyboard)
     {
-        return sendMessage(msg, message, keyboard.getJSON());
+        addInlineKeyboard(keyboard);
+        return sendTextMessage(msg, message, nullptr, &keyboard);
     }
 
-    inline void sendMessage(const TBMessage &msg, const char* message, ReplyKeyboard &keyboard) {
-        return sendMessage(msg, message, keyboard.getJSON());
+    inline bool sendMessage(const TBMessage &msg, const char* message, ReplyKeyboard &keyboard) {
+        return sendTextMessage(msg, message, nullptr, &keyboard);
+    }
+
+    // send a formatted message (msg.isMarkdownEnabled or msg.isHTMLenabled) with some text that has
+    // to be shown as-is (i.e. written by users): each %s of the template is replaced by the next
+    // argument, with the reserved characters of the parse mode escaped. %% is a single '%'.
+    // Text is escaped while the request is written, without copies
+    // i.e. sendFormatted(msg, "*%s* wrote: _%s_", { msg.sender.firstName, msg.text })
+    // params
+    //   msg     : the TBMessage telegram recipient (and parse mode)
+    //   format  : the message template, with markup (not escaped)
+    //   args    : the texts for each %s
+    //   keyboard: the inline/reply keyboard (optional, in json format)
+    // returns
+    //   true if the request was accepted (sent or queued)
+    inline bool sendFormatted(const TBMessage &msg, const char* format, std::initializer_list<const char*> args,
+                              String keyboard = "")
+    {
+        return sendTextMessage(msg, format, keyboard.c_str(), nullptr, args.begin(), args.size());
     }
 
     // Send message to a channel. This bot must be in the admin group
-    void sendToChannel(const char*  &channel, String &message, bool silent) ;
+    bool sendToChannel(const char*  &channel, String &message, bool silent) ;
 
     // Send message to a specific user. In order to work properly two conditions is needed:
     //  - You have to find the userid (for example using the bot @JsonBumpBot  https://t.me/JsonDumpBot)
     //  - User has to start your bot in it's own client. For example send a message with @<your bot name>
-    void sendTo(const int32_t userid, String &message, String keyboard = "") ;
+    bool sendTo(const int32_t userid, const char* message, String keyboard = "") ;
+
+    inline bool sendTo(const int32_t userid, String &message, String keyboard = "") {
+        return sendTo(userid, message.c_str(), keyboard);
+    }
+
+    // Send the same message to many chats. The request body is serialized only once and the
+    // requests are sent one after the other on the same connection (within the rate limits).
+    // This function is blocking: it returns when all the replies have been received
+    // params
+    //   ids     : the array of destination chat ids
+    //   count   : the number of destinations
+    //   message : the message to send
+    //   keyboard: the inline/reply keyboard (optional)
+    //   results : optional array of count elements, set to true for each message delivered
+    // returns
+    //   the number of messages delivered
+    size_t broadcast(const int64_t* ids, size_t count, const char* message, const String& keyboard = "", bool* results = nullptr);
+
+    inline size_t broadcast(const int64_t* ids, size_t count, const char* message, InlineKeyboard &keyboard, bool* results = nullptr) {
+        addInlineKeyboard(keyboard);
+        return broadcast(ids, count, message, keyboard.getJSON(), results);
+    }
+
+    inline size_t broadcast(const int64_t* ids, size_t count, const char* message, ReplyKeyboard &keyboard, bool* results = nullptr) {
+        return broadcast(ids, count, message, keyboard.getJSON(), results);
+    }
 
 	// Backward compatibility.
-	inline void sendToUser(const int32_t userid, String &message, String keyboard = "")  __attribute__ ((deprecated))
+	inline bool sendToUser(const int32_t userid, const char* message, String keyboard = "")  __attribute__ ((deprecated))
 	{
-		sendTo(userid, message, keyboard);
+		return sendTo(userid, message, keyboard);
 	}
-	inline void sendToGroup(const int32_t userid, String &message, String keyboard = "")  __attribute__ ((deprecated))
+	inline bool sendToUser(const int32_t userid, String &message, String keyboard = "")  __attribute__ ((deprecated))
 	{
-		sendTo(userid, message, keyboard);
+		return sendTo(userid, message.c_str(), keyboard);
+	}
+	inline bool sendToGroup(const int32_t userid, const char* message, String keyboard = "")  __attribute__ ((deprecated))
+	{
+		return sendTo(userid, message, keyboard);
+	}
+	inline bool sendToGroup(const int32_t userid, String &message, String keyboard = "")  __attribute__ ((deprecated))
+	{
+		return sendTo(userid, message.c_str(), keyboard);
 	}
 
-    void sendPhotoByUrl(const uint32_t& chat_id,  const String& url, const String& caption);
+    bool sendPhotoByUrl(const uint32_t& chat_id,  const String& url, const String& caption);
 
-	inline void sendPhotoByUrl(const TBMessage &msg,  const String& url, const String& caption){
-		sendPhotoByUrl(msg.sender.id, url, caption);
+	inline bool sendPhotoByUrl(const TBMessage &msg,  const String& url, const String& caption){
+		return sendPhotoByUrl(msg.sender.id, url, caption);
 	}
 
     bool sendPhotoByFile(const uint32_t& chat_id,  const String& fileName, fs::FS& filesystem);
@@ -178,6 +407,101 @@ public:
         return sendPhotoByFile(msg.sender.id, fileName, filesystem );
     }
 
+    // send a photo or a document stored in RAM/PSRAM (i.e. a camera frame buffer) without using a filesystem
+    // params
+    //   chat_id : the recipient chat ID
+    //   data    : pointer to the binary content
+    //   size    : the content size in bytes
+    //   fileName: the name of the file shown in Telegram
+    //   contentType: the MIME type of document (i.e. "application/pdf")
+    // returns
+    //   true if no error
+    bool sendPhotoFromBuffer(const uint32_t& chat_id, const uint8_t* data, size_t size, const char* fileName = "photo.jpg");
+
+    inline bool sendPhotoFromBuffer(const TBMessage &msg, const uint8_t* data, size_t size, const char* fileName = "photo.jpg") {
+        return sendPhotoFromBuffer(msg.sender.id, data, size, fileName);
+    }
+
+    bool sendDocumentFromBuffer(const uint32_t& chat_id, const uint8_t* data, size_t size,
+                                const char* fileName, const char* contentType = "application/octet-stream");
+
+    inline bool sendDocumentFromBuffer(const TBMessage &msg, const uint8_t* data, size_t size,
+                                const char* fileName, const char* contentType = "application/octet-stream") {
+        return sendDocumentFromBuffer(msg.sender.id, data, size, fileName, contentType);
+    }
+
+    // send a photo or a document reading the content from a generic stream source
+    // params
+    //   chat_id : the recipient chat ID
+    //   stream  : the source of binary content (File, client, custom Stream...)
+    //   size    : the number of bytes to be read from stream
+    //   fileName: the name of the file shown in Telegram
+    //   contentType: the MIME type of document (i.e. "application/pdf")
+    // returns
+    //   true if no error
+    bool sendPhotoFromStream(const uint32_t& chat_id, Stream& stream, size_t size, const char* fileName = "photo.jpg");
+
+    bool sendDocumentFromStream(const uint32_t& chat_id, Stream& stream, size_t size,
+                                const char* fileName, const char* contentType = "application/octet-stream");
+
+    // set a function called after each block of an upload has been sent
+    // params
+    //   onProgress: function with arguments (size_t sent, size_t total)
+    inline void onUploadProgress(UploadProgressCallback onProgress) { m_uploadProgress = onProgress; }
+
+    // set a function called when an upload is completed
+    // params
+    //   onDone: function with arguments (bool ok, const char* fileId)
+    //           fileId is the id assigned by Telegram (can be used to send again the same file)
+    inline void onUploadDone(UploadDoneCallback onDone) { m_uploadDone = onDone; }
+
+    // set how many times an upload is restarted if the connection drops (only buffers and files)
+    inline void setUploadRetries(uint8_t retries) { m_uploadRetries = retries; }
+
+    // download a received document (file link from getFile(), valid for one hour).
+    // Content is streamed in BLOCK_SIZE chunks on the bot connection; if the connection drops,
+    // the transfer is resumed from the last written byte (HTTP Range) up to DOWNLOAD_RETRIES times.
+    // This function is blocking
+    // params
+    //   doc   : the document of a MessageDocument message
+    //   out   : where the content is written
+    //   offset: bytes already received (i.e. by an interrupted download), 0 for whole file
+    // returns
+    //   true if the whole file has been written
+    bool downloadFile(const TBDocument &doc, Print &out, size_t offset = 0);
+
+    // download a document to a file. If the file already exists it is considered an interrupted
+    // download of the same document, so only the missing part is requested
+    bool downloadFile(const TBDocument &doc, fs::FS &fs, const char* path);
+
+    // download a document to a memory buffer (size must be at least doc.file_size)
+    bool downloadFile(const TBDocument &doc, uint8_t* buffer, size_t size);
+
+    // set a function called after each block of a download has been written
+    // params
+    //   onProgress: function with arguments (size_t received, size_t total)
+    inline void onDownloadProgress(DownloadProgressCallback onProgress) { m_downloadProgress = onProgress; }
+
+    // install a firmware image received as document. Content is streamed from the bot connection
+    // straight to flash (Update), without storing it; on ESP32 a block is written to flash while the
+    // next one is received. The new firmware is activated only if the whole image has been written
+    // and the hash (if any) matches. Received updates are confirmed to server before rebooting,
+    // otherwise the same message would install the firmware again after the restart.
+    // This function is blocking
+    // params
+    //   doc   : the document of a MessageDocument message (file link from getFile())
+    //   hash  : expected MD5 (32 hex digits) or SHA-256 (64 hex digits) of the image, nullptr for none
+    //   reboot: restart the board when done
+    // returns
+    //   true if the new firmware is ready (only when reboot is false)
+    bool updateFirmware(const TBDocument &doc, const char* hash = nullptr, bool reboot = true);
+
+    // confirm to server the updates delivered so far by getNewMessage(), so they won't be sent again
+    // (i.e. before a reboot). Messages still queued are not confirmed
+    // returns
+    //    true if no error occurred
+    bool commitUpdates();
+
     // terminate a query started by pressing an inlineKeyboard button. The steps are:
     // 1) send a message with an inline keyboard
     // 2) wait for a <message> (getNewMessage) of type MessageQuery
@@ -187,7 +511,7 @@ public:
     //   message  : an optional message
     //   alertMode: false -> a simply popup message
     //              true --> an alert message with ok button
-    void endQuery(const TBMessage &msg, const char* message, bool alertMode = false);
+    bool endQuery(const TBMessage &msg, const char* message, bool alertMode = false);
 
     // remove an active reply keyboard for a selected user, sending a message
     // params:
@@ -198,7 +522,7 @@ public:
     //                       2) if the bot's message is a reply (has reply_to_message_id), sender of the original message
     // return:
     //   true if no error occurred
-    void removeReplyKeyboard(const TBMessage &msg, const char* message, bool selective = false);
+    bool removeReplyKeyboard(const TBMessage &msg, const char* message, bool selective = false);
 
     // set if unsecure connection has to be used with telegram server.
     // This is for backwar compatibility, but using a root certificate is strongly suggested
@@ -207,9 +531,60 @@ public:
     }
 
     // Use this method to edit only the reply markup of messages.
-    void editMessageReplyMarkup(TBMessage &msg, String keyboard = "");
-    void editMessageReplyMarkup(TBMessage &msg, InlineKeyboard &keyboard);
+    bool editMessageReplyMarkup(TBMessage &msg, String keyboard = "");
+    bool editMessageReplyMarkup(TBMessage &msg, InlineKeyboard &keyboard);
+
+    // make the callbacks of an inline keyboard reachable from getNewMessage().
+    // Keyboards sent with sendMessage() or editMessageReplyMarkup() are added automatically,
+    // call this only for keyboards already shown (i.e. sent before a reboot)
+    // returns:
+    //    false if there isn't enough space for the keyboard callbacks
+    inline bool addInlineKeyboard(const InlineKeyboard &keyboard) { return m_callbacks.add(keyboard); }
+
+    // forget the callbacks of all inline keyboards
+    inline void clearInlineKeyboards() { m_callbacks.clear(); }
+
+    // enable/disable pacing of outgoing messages within Telegram limits (about 1 message/s
+    // for each chat and 30 messages/s overall). Default value is true (enabled).
+    // Sending is also paused for the time requested by a "429 Too Many Requests" reply, then the
+    // rejected message is sent again. Messages waiting for a slot are held (up to HELD_REQUESTS_SIZE):
+    // loop() is never blocked, and other chats and requests that are not messages don't wait for them
+    inline void enableRateLimit(bool value) { m_rateLimiter.enable(value); }
+
+    // set what to do when the outgoing requests queue is full (ESP32 only)
+    // params:
+    //    policy: QueueBlock      -> wait up to SERVER_TIMEOUT until a request has been sent (default)
+    //            QueueDropOldest -> discard the oldest request still waiting
+    //            QueueFail       -> discard the new request (send function return false)
+    inline void setQueuePolicy(QueueOverflowPolicy policy) { m_queuePolicy = policy; }
+
+    // number of requests sent (or queued) and still waiting for the server reply
+    // (0 when every message sent so far has been delivered to the server)
+#if defined(ESP32)
+    inline uint8_t pendingRequests() const { return m_requests.size() + m_heldRequests.size() + m_requestBusy; }
+#else
+    inline uint8_t pendingRequests() const { return m_requests.size() + m_heldRequests.size() + m_pendingCount; }
+#endif
+
+
+    // number of new connections (TLS handshakes) to Telegram server since start.
+    // With keep-alive working, it grows only when the server closes the connection
+    inline uint32_t getHandshakes() const { return m_handshakes; }
 
+    // memory usage of the JSON arena (fallbacks > 0 means JSON_ARENA_SIZE is too small)
+    inline JsonArena::Stats getArenaStats() const { return m_arena.stats(); }
+
+    // performance counters: requests for each method, latency histograms, bytes sent/received,
+    // reconnections, dropped requests and heap low water mark
+    TBStats getStats();
+
+    // answer automatically to "/stats" command with the bot counters (see getStats()).
+    // Command is accepted only from the admin user, ignored from anybody else
+    // params
+    //    adminId: Telegram user id of the bot administrator
+    // returns
+    //    false if there isn't enough space for a new command
+    bool enableStatsCommand(int64_t adminId);
 
     void setClock(const char* TZ);
     bool getUpdates();
@@ -217,12 +592,38 @@ public:
 
 private:
     IPAddress telegramServerIP;
+    char            m_host[64] = TELEGRAM_HOST;
+    uint16_t        m_port = TELEGRAM_PORT;
+    bool            m_serverTLS = true;
     StaticJsonDocument<BUFFER_SMALL> smallDoc;
     const char*     m_token;
     const char*     m_botName;
     int32_t         m_lastUpdate = 0;
     uint32_t        m_lastUpdateTime;
     uint32_t        m_minUpdateTime = 2000;
+    uint32_t        m_requestTime = 0;         // ESP8266: when the oldest pending request was sent
+    uint8_t         m_pollTimeout = SHORT_POLL_TIMEOUT;
+    bool            m_longPolling = false;
+    QueueOverflowPolicy m_queuePolicy = QueueBlock;
+    RateLimiter     m_rateLimiter;
+
+    UploadProgressCallback  m_uploadProgress = nullptr;
+    UploadDoneCallback      m_uploadDone = nullptr;
+    uint8_t                 m_uploadRetries = 2;
+    DownloadProgressCallback m_downloadProgress = nullptr;
+
+    volatile uint32_t m_handshakes = 0;
+    BotStats        m_stats;
+
+    volatile BotState m_state = BotIdle;
+    uint32_t        m_stateTime = 0;
+    volatile bool   m_identified = false;   // getMe reply received (or identity loaded from cache)
+    ReadyCallback   m_onReady = nullptr;
+
+    bool            m_cacheEnabled = false;
+    fs::FS*         m_cacheFS = nullptr;
+    const char*     m_cachePath = STARTUP_CACHE_FILE;
+    TBStartupCache  m_cache = {};       // m_user strings point here
 
     bool            m_useDNS = false;
     bool            m_UTF8Encoding = false;
@@ -230,29 +631,95 @@ private:
     uint8_t         m_fingerprint[20];
     TBUser          m_user;
 
-    InlineKeyboard  m_inlineKeyboard;   // last inline keyboard showed in bot
+    CallbackRegistry m_callbacks;       // callbacks of all the inline keyboards showed in bot
+    CommandRouter   m_commands;         // handlers registered with onCommand()
+    MessageHandler  m_handlers[MessageReply + 1];   // handlers registered with onMessage()
+    MessageHandler  m_defaultHandler = nullptr;
+
+    // Messages parsed from last getUpdates reply and not yet read (ring buffer)
+    TBMessage       m_messages[UPDATES_QUEUE_SIZE];
+    int32_t         m_msgOffsets[UPDATES_QUEUE_SIZE];   // offset that confirms each queued message
+    uint8_t         m_msgHead = 0;
+    uint8_t         m_msgCount = 0;
+    int32_t         m_deliveredUpdate = 0;      // offset after the last message returned by getNewMessage()
+    uint8_t         m_updatesLimit = UPDATES_QUEUE_SIZE;
+
+    // Webhook mode (nullptr while polling)
+    WiFiServer*     m_webhookServer = nullptr;
+    String          m_webhookSecret;
+
+    // Memory for all the JSON documents (must be declared before m_updatesDoc)
+    JsonArena       m_arena;
+
+    // Last getUpdates reply (parsed messages have their own copy of the strings)
+    ArenaJsonDocument m_updatesDoc;
+    DeserializationError m_updatesError;
+    StaticJsonDocument<UPDATES_FILTER_SIZE> m_updatesFilter;
 
     // Struct for store telegram server reply and infos about it
     HttpServerReply httpData;
 
+    // getUpdates requests have their own connection, so a long poll never delays the other requests
+    // (on ESP32 it's used only by httpPostTask)
+    WiFiClient*     m_pollClient = nullptr;
+    volatile bool   m_pollPending = false;      // a getUpdates request has been written on m_pollClient
+    uint32_t        m_pollSent = 0;
+    uint32_t        m_pollDeadline = SERVER_TIMEOUT;
+
+    // Outgoing requests waiting to be sent (by httpPostTask on ESP32, by sendQueued() on ESP8266)
+    RequestQueue<TBRequest, REQUEST_QUEUE_SIZE> m_requests;
+    // Messages taken from m_requests and waiting for the rate limiter
+    HeldRequests<HELD_REQUESTS_SIZE> m_heldRequests;
+
+    // get the next request to send: a held message allowed by the rate limiter or the first queued
+    // request. Queued messages that can't be sent yet are held, so the requests behind don't wait
+    // returns
+    //    false if there is nothing to send now
+    bool nextRequest(TBRequest &request);
+
 #if defined(ESP32)
-    // WiFiClientSecure telegramClient;
-    WiFiClientSecure *telegramClient;
-    TaskHandle_t taskHandler;
+    WiFiClient *telegramClient = nullptr;
+    TaskHandle_t taskHandler = nullptr;
+    // telegramClient is shared between httpPostTask and blocking functions
+    SemaphoreHandle_t m_clientMutex;
+    volatile bool m_requestBusy = false;        // httpPostTask is handling a request from m_requests
+    // Given by httpPostTask when a getUpdates reply is ready (wakes up handleMessages)
+    UpdatesSignal m_updatesSignal;
 #elif defined(ESP8266)
-    BearSSL::WiFiClientSecure* telegramClient;
+    WiFiClient*         telegramClient = nullptr;
     BearSSL::Session*   m_session;
     BearSSL::X509List*  m_cert;
+    // Requests sent on telegramClient and waiting for reply (getUpdates replies come on m_pollClient)
+    uint8_t             m_pendingCount = 0;
+    // Messages sent and waiting for reply (bit i of m_pendingMessages: i-th pending reply is one of them)
+    RequestQueue<TBRequest, REQUEST_QUEUE_SIZE> m_sentMessages;
+    uint32_t            m_pendingMessages = 0;
+
+    // read the next pending reply from server (a message rejected with 429 is queued again)
+    void readReply();
+
+    // send the queued requests allowed by the rate limiter
+    void sendQueued();
+
+    // count a request written on telegramClient
+    // params
+    //   message: the message sent (kept until the reply to send it again after a 429 error)
+    void addPending(TBRequest* message = nullptr);
+
+    // pending replies are lost (i.e. connection closed)
+    void dropPending();
 #endif
 
     // send commands to the telegram server. For info about commands, check the telegram api https://core.telegram.org/bots/api
     // params
     //   command   : the command to send, i.e. getMe
     //   parameters: optional parameters
+    //   blocking  : wait for the reply and parse it in smallDoc
+    //   filter    : optional ArduinoJson filter for the reply (blocking only)
     // returns
-    //   an empty string if error
-    //   a string containing the Telegram JSON response
-    bool postCommand(const char* const& command, const char* const& param, bool blocking = false);
+    //   true if the request has been sent (and with blocking, the reply parsed)
+    bool postCommand(const char* const& command, const char* const& param, bool blocking = false,
+                     const JsonDocument* filter = nullptr);
 
 
     /*  postCommand() must be a blocking function. It will send an http request to server and wait for reply.
@@ -265,7 +732,23 @@ private:
     static void httpPostTask(void *args);
 
     // helper function used to select the properly working mode with ESP8266/ESP32
-    void sendCommand(const char* const&  command, const char* const& param);
+    // returns
+    //   true if the request was sent (ESP8266) or queued (ESP32)
+    // chatId: destination of a message for the rate limiter (0 if the request is not a message)
+    bool sendCommand(const char* const&  command, const char* const& param, int64_t chatId = 0);
+
+    // send a request whose JSON body is written by body.write(JsonWriter&), called twice:
+    // first for the Content-Length, then to write the body straight to the client (ESP8266)
+    // or to the queued request (ESP32)
+    template <typename Body>
+    bool sendRequest(const char* command, const Body &body, int64_t chatId = 0);
+
+    // write the http request line and headers
+    void writeRequestHeaders(Print &out, const char* command, size_t length);
+
+    // sendMessage and its overloads (keyboard is a JSON string or a keyboard object)
+    bool sendTextMessage(const TBMessage &msg, const char* message, const char* keyboard, const KeyboardLayout* layout,
+                         const char* const* args = nullptr, size_t argsCount = 0);
 
 
     // upload documents to Telegram server https://core.telegram.org/bots/api#sending-files
@@ -281,6 +764,40 @@ private:
                             const String& fileName, const char* contentType,
                             const char* binaryPropertyName, fs::FS& fs );
 
+    // sendMultipartFormData overloads: content read from a stream or from a memory buffer
+    bool sendMultipartFormData( const char* command,  const uint32_t& chat_id,
+                            const char* fileName, const char* contentType,
+                            const char* binaryPropertyName, Stream& stream, size_t size );
+
+    bool sendMultipartFormData( const char* command,  const uint32_t& chat_id,
+                            const char* fileName, const char* contentType,
+                            const char* binaryPropertyName, const uint8_t* data, size_t size );
+
+    // upload engine used by all sendMultipartFormData overloads
+    bool sendMultipartFormData( const char* command,  const uint32_t& chat_id,
+                            const char* fileName, const char* contentType,
+                            const char* binaryPropertyName, UploadSource& source );
+
+    // send the binary content of an upload
+    // returns
+    //   true if all the content was sent
+    bool writeUploadContent(UploadSource& source);
+
+    // read the server reply for an upload
+    // params
+    //   fileId: buffer for the file_id assigned by Telegram
+    //   size  : size of fileId buffer
+    // returns
+    //   1 if upload was successful, 0 if refused by server, -1 if no reply was received
+    int8_t readUploadReply(char* fileId, size_t size);
+
+    // send request headers and the form data preceding the binary content of a multipart upload
+    // returns
+    //   true if no error
+    bool beginMultipartFormData( const char* command,  const uint32_t& chat_id,
+                            const char* fileName, const char* contentType,
+                            const char* binaryPropertyName, size_t size );
+
     // get some information about the bot
     // params
     //   user: the data structure that will contains the data retreived
@@ -288,10 +805,89 @@ private:
     //   true if no error occurred
     bool getMe(TBUser &user);
 
-    bool checkConnection();
+    // store a copy of bot identity (m_user and userName)
+    void setIdentity(int32_t id, const char* username, const char* firstName);
+
+    // load startup cache (if enabled) and restore bot identity, last update offset and TLS session
+    // returns
+    //    true if cache is valid
+    bool loadStartupCache();
+
+    // offset that confirms the updates delivered by getNewMessage() (not the ones still queued)
+    inline int32_t deliveredUpdate() const { return m_msgCount == 0 ? m_lastUpdate : m_deliveredUpdate; }
+
+    // create and configure telegramClient and m_pollClient, then start the httpPostTask (ESP32)
+    void setupClient();
+
+    // create a client for the current server (TLS or plain TCP, see setServer())
+    WiFiClient* createClient();
+
+    // set timeout, certificate and TLS options of a client
+    void configureClient(WiFiClientSecure* client);
+
+    // next step of beginAsync()
+    void startupStep();
+
+    // connect telegramClient (if needed)
+    inline bool checkConnection() { return connectClient(telegramClient); }
+
+    // connect a client to Telegram server (if needed)
+    // returns
+    //    true if the client is connected
+    bool connectClient(WiFiClient* client);
+
+    // write a getUpdates request on the polling connection
+    // params
+    //   body  : the JSON request body
+    //   length: the body length
+    // returns
+    //    true if the request has been sent
+    bool sendPoll(const char* body, size_t length);
+
+    // read the getUpdates reply as soon as it is available (it never waits for it)
+    void readPoll();
 
     bool serverReply(const char* const&  replyMsg);
 
+    // read status line and headers of a server reply
+    // params
+    //   status: if not nullptr, set to the HTTP status code
+    // returns
+    //   the length of reply body (-1 if unknown)
+    int32_t readReplyHeaders(Stream &stream, int16_t* status = nullptr);
+
+    // wait for the headers of a blocking request reply (time to first byte is counted)
+    // returns
+    //   the length of reply body (-1 if unknown)
+    int32_t waitReplyHeaders(int16_t* status = nullptr);
+
+    // parse the body of a server reply directly from stream (getUpdates reply is stored in m_updatesDoc)
+    // params
+    //   stream  : the client stream
+    //   length  : the body length (-1 if unknown)
+    //   isUpdate: true if this is the reply to a getUpdates request
+    // returns
+    //   0 if reply is ok, Telegram error_code otherwise (-1 if reply can't be parsed)
+    int16_t parseReply(Stream &stream, int32_t length, bool isUpdate);
+
+    // parse the getUpdates reply stored in m_updatesDoc and fill the messages queue
+    // returns
+    //   the number of messages queued
+    uint8_t parseUpdates();
+
+    // parse a single update object
+    // returns
+    //   true if the update contains a supported message type
+    bool parseMessage(JsonObject update, TBMessage &message);
+
+    // accept an update POSTed by Telegram server to the webhook and queue its message
+    // returns
+    //   true if a message has been queued
+    bool readWebhook();
+
+    // sleep until a getUpdates reply is ready (ESP32) or the next request can be sent
+    void waitForUpdates(uint32_t timeout);
+
 };
 
 #endif
@@ -0,0 +1,92 @@
+#include "AsyncTelegram.h"
+
+// Upper limits (ms) of latency histogram buckets, last bucket has no limit
+static const uint32_t bucketLimits[STATS_BUCKETS - 1] = { 10, 30, 100, 300, 1000, 3000, 10000 };
+
+
+BotStats::BotStats()
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_stats.minFreeBlock = UINT32_MAX;
+}
+
+
+void BotStats::countRequest(const char* method, size_t bytes)
+{
+	m_stats.bytesOut += bytes;
+	sampleHeap();
+	for (uint8_t i = 0; i < STATS_METHODS; i++) {
+		TBStats::Method &entry = m_stats.methods[i];
+		if (entry.count == 0) {
+			// First request for this method: take the free entry
+			strlcpy(entry.name, method, STATS_METHOD_NAME);
+			entry.count = 1;
+			return;
+		}
+		if (strncmp(entry.name, method, STATS_METHOD_NAME - 1) == 0) {
+			entry.count++;
+			return;
+		}
+	}
+	m_stats.otherMethods++;
+}
+
+
+void BotStats::addLatency(LatencyType type, uint32_t ms)
+{
+	uint8_t bucket = 0;
+	while (bucket < STATS_BUCKETS - 1 && ms >= bucketLimits[bucket])
+		bucket++;
+	m_stats.latency[type][bucket]++;
+}
+
+
+void BotStats::sampleHeap()
+{
+#if defined(ESP32)
+	uint32_t block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+	uint32_t block = ESP.getMaxFreeBlockSize();
+#endif
+	if (block < m_stats.minFreeBlock)
+		m_stats.minFreeBlock = block;
+}
+
+
+void BotStats::format(const TBStats &stats, String &out)
+{
+	char line[96];
+	out.reserve(out.length() + 640);
+	out += "Requests:";
+	for (uint8_t i = 0; i < STATS_METHODS && stats.methods[i].count > 0; i++) {
+		snprintf(line, sizeof(line), "\n  %s %u", stats.methods[i].name, stats.methods[i].count);
+		out += line;
+	}
+	if (stats.otherMethods > 0) {
+		snprintf(line, sizeof(line), "\n  other %u", stats.otherMethods);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "\nBytes out/in: %u / %u", stats.bytesOut, stats.bytesIn);
+	out += line;
+	snprintf(line, sizeof(line), "\nHandshakes: %u, resets: %u, dropped: %u, skipped updates: %u",
+			 stats.handshakes, stats.resets, stats.droppedSends, stats.skippedUpdates);
+	out += line;
+	snprintf(line, sizeof(line), "\nMin free block: %u", stats.minFreeBlock);
+	out += line;
+	snprintf(line, sizeof(line), "\nJSON arena: %u / %u (max %u), fallbacks %u",
+			 (uint32_t) stats.arena.used, (uint32_t) stats.arena.capacity,
+			 (uint32_t) stats.arena.highWater, stats.arena.fallbacks);
+	out += line;
+
+	out += "\nLatency ms (connect / first byte / body):";
+	for (uint8_t i = 0; i < STATS_BUCKETS; i++) {
+		if (i < STATS_BUCKETS - 1)
+			snprintf(line, sizeof(line), "\n  <%u: ", bucketLimits[i]);
+		else
+			snprintf(line, sizeof(line), "\n  >=%u: ", bucketLimits[i - 1]);
+		out += line;
+		snprintf(line, sizeof(line), "%u / %u / %u", stats.latency[LatencyConnect][i],
+				 stats.latency[LatencyFirstByte][i], stats.latency[LatencyBody][i]);
+		out += line;
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef BOT_STATS
+#define BOT_STATS
+
+#include <Arduino.h>
+#include "JsonArena.h"
+
+#ifndef STATS_METHODS
+#define STATS_METHODS			16		// number of Bot API methods counted one by one
+#endif
+#define STATS_METHOD_NAME		24
+#define STATS_BUCKETS			8		// latency histogram: <10, <30, <100, <300, <1000, <3000, <10000, >=10000 ms
+
+enum LatencyType {
+	LatencyConnect   = 0,	// TCP connection and TLS handshake
+	LatencyFirstByte = 1,	// from request sent to reply headers received
+	LatencyBody      = 2,	// reply body read and parsed
+	LatencyTypes     = 3
+};
+
+
+// Performance counters of the bot (see AsyncTelegram::getStats())
+struct TBStats {
+	struct Method {
+		char		name[STATS_METHOD_NAME];
+		uint32_t	count;
+	};
+	Method		methods[STATS_METHODS];		// requests for each Bot API method
+	uint32_t	otherMethods;				// requests of methods not fitting in the table
+	uint32_t	latency[LatencyTypes][STATS_BUCKETS];
+	uint32_t	bytesOut;					// request bodies
+	uint32_t	bytesIn;					// reply bodies
+	uint32_t	handshakes;					// new connections to server
+	uint32_t	resets;						// connection resets (no reply from server)
+	uint32_t	droppedSends;				// requests not sent (queue full or no connection)
+	uint32_t	skippedUpdates;				// updates too big for the updates document (never delivered)
+	uint32_t	minFreeBlock;				// low water mark of the largest free heap block
+	JsonArena::Stats arena;
+};
+
+
+// Counters are updated both by httpPostTask and by the loop() task without locks:
+// they are only statistics, a lost increment is not a problem
+class BotStats
+{
+public:
+	BotStats();
+
+	// count a request sent to server
+	// params:
+	//   method: Bot API method name (i.e. "sendMessage")
+	//   bytes : length of request body
+	void countRequest(const char* method, size_t bytes);
+
+	inline void countReply(size_t bytes) { m_stats.bytesIn += bytes; }
+	inline void countReset() { m_stats.resets++; }
+	inline void countDropped() { m_stats.droppedSends++; }
+	inline void countSkipped() { m_stats.skippedUpdates++; }
+
+	// add a sample to a latency histogram
+	void addLatency(LatencyType type, uint32_t ms);
+
+	// update the low water mark of largest free heap block
+	void sampleHeap();
+
+	inline const TBStats& get() const { return m_stats; }
+
+	// write stats as human readable text (i.e. for a Telegram message)
+	static void format(const TBStats &stats, String &out);
+
+private:
+	TBStats		m_stats;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "CallbackRegistry.h"
+#include "Utilities.h"
+
+
+uint32_t CallbackRegistry::hash(const char* data)
+{
+	return fnv1a(data, strlen(data));
+}
+
+
+uint8_t CallbackRegistry::find(const char* data, uint32_t hash) const
+{
+	uint8_t slot = hash & (CALLBACK_TABLE_SIZE - 1);
+	// Table is never full (twice the nodes), so an empty slot is always found
+	while (m_table[slot] != 0) {
+		const Node &node = m_nodes[m_table[slot] - 1];
+		if (node.hash == hash && strcmp(m_text + node.key, data) == 0)
+			break;
+		slot = (slot + 1) & (CALLBACK_TABLE_SIZE - 1);
+	}
+	return slot;
+}
+
+
+void CallbackRegistry::clear()
+{
+	memset(m_table, 0, sizeof(m_table));
+	for (uint8_t i = 0; i < m_count; i++)
+		m_nodes[i].callback = nullptr;
+	m_count = 0;
+	m_textLength = 0;
+}
+
+
+bool CallbackRegistry::add(const char* data, CallbackType callback)
+{
+	uint32_t h = hash(data);
+	uint8_t slot = find(data, h);
+	if (m_table[slot] != 0) {
+		// Same query data already registered: replace callback
+		m_nodes[m_table[slot] - 1].callback = callback;
+		return true;
+	}
+
+	size_t len = strlen(data) + 1;
+	if (m_count >= CALLBACK_MAX || m_textLength + len > CALLBACK_TEXT_SIZE)
+		return false;
+
+	Node &node = m_nodes[m_count];
+	node.hash = h;
+	node.key = m_textLength;
+	node.callback = callback;
+	memcpy(m_text + m_textLength, data, len);
+	m_textLength += len;
+	m_table[slot] = ++m_count;
+	return true;
+}
+
+
+void CallbackRegistry::removeOldest()
+{
+	if (m_count == 0)
+		return;
+	// Strings are stored in the same order of nodes: the oldest one is at the start of text buffer
+	uint16_t len = m_count > 1 ? m_nodes[1].key : m_textLength;
+	memmove(m_text, m_text + len, m_textLength - len);
+	m_textLength -= len;
+	for (uint8_t i = 1; i < m_count; i++) {
+		m_nodes[i - 1] = m_nodes[i];
+		m_nodes[i - 1].key -= len;
+	}
+	m_count--;
+	m_nodes[m_count].callback = nullptr;
+
+	memset(m_table, 0, sizeof(m_table));
+	for (uint8_t i = 0; i < m_count; i++)
+		m_table[find(m_text + m_nodes[i].key, m_nodes[i].hash)] = i + 1;
+}
+
+
+bool CallbackRegistry::add(const InlineKeyboard &keyboard)
+{
+	// Space is needed only for the buttons not registered yet: forget the oldest callbacks until they fit
+	// (one of them could be a button of this keyboard, so space is checked again each time)
+	for (;;) {
+		uint8_t count = 0;
+		size_t textLength = 0;
+		for (uint8_t i = 0; i < keyboard.m_buttonsCount; i++) {
+			if (keyboard.m_buttons[i].type != KeyboardButtonQuery || keyboard.m_callbacks[i] == nullptr)
+				continue;
+			const char* data = keyboard.getText(keyboard.m_buttons[i].data);
+			if (contains(data))
+				continue;
+			count++;
+			textLength += strlen(data) + 1;
+		}
+		if (count > CALLBACK_MAX || textLength > CALLBACK_TEXT_SIZE)
+			return false;
+		if (m_count + count <= CALLBACK_MAX && m_textLength + textLength <= CALLBACK_TEXT_SIZE)
+			break;
+		removeOldest();
+	}
+
+	bool ok = true;
+	for (uint8_t i = 0; i < keyboard.m_buttonsCount; i++) {
+		if (keyboard.m_buttons[i].type != KeyboardButtonQuery || keyboard.m_callbacks[i] == nullptr)
+			continue;
+		ok &= add(keyboard.getText(keyboard.m_buttons[i].data), keyboard.m_callbacks[i]);
+	}
+	return ok;
+}
+
+
+bool CallbackRegistry::invoke(const TBMessage &msg) const
+{
+	if (msg.callbackQueryData == nullptr || m_count == 0)
+		return false;
+
+	uint8_t slot = find(msg.callbackQueryData, hash(msg.callbackQueryData));
+	if (m_table[slot] == 0)
+		return false;
+
+	const Node &node = m_nodes[m_table[slot] - 1];
+	if (node.callback == nullptr)
+		return false;
+	node.callback(msg);
+	return true;
+}
@@ -0,0 +1,78 @@
+#ifndef CALLBACK_REGISTRY
+#define CALLBACK_REGISTRY
+
+#include <Arduino.h>
+#include "InlineKeyboard.h"
+
+#ifndef CALLBACK_MAX
+#define CALLBACK_MAX			32		// max number of callbacks reachable at the same time (all keyboards)
+#endif
+#ifndef CALLBACK_TEXT_SIZE
+#define CALLBACK_TEXT_SIZE		768		// buffer for all registered callback data strings
+#endif
+#define CALLBACK_TABLE_SIZE		(CALLBACK_MAX * 2)
+
+
+// Bot-wide table of inline keyboard callbacks, indexed by the exact callback data string.
+// Callbacks are stored in a fixed pool of nodes and found with an open addressing hash table
+// (linear probing), so a callback query is dispatched in constant time whatever keyboard it comes from.
+// Nodes and strings are kept in registration order: when there is no room left for a new keyboard,
+// the oldest callbacks are removed until it fits.
+class CallbackRegistry
+{
+public:
+	using CallbackType = InlineKeyboard::CallbackType;
+
+	CallbackRegistry() { clear(); }
+
+	// register (or replace) the callback for a query data string
+	// returns:
+	//   false if there isn't enough space
+	bool add(const char* data, CallbackType callback);
+
+	// register all query buttons of a keyboard that have a callback function
+	// (buttons already registered, i.e. keyboard sent again, don't need more space)
+	// returns:
+	//   false if keyboard callbacks doesn't fit in the table
+	bool add(const InlineKeyboard &keyboard);
+
+	// call the function registered for the query data of the message
+	// returns:
+	//   true if a callback was found
+	bool invoke(const TBMessage &msg) const;
+
+	// remove all callbacks
+	void clear();
+
+	// Number of registered callbacks
+	inline uint8_t size() const { return m_count; }
+
+private:
+	static_assert((CALLBACK_TABLE_SIZE & (CALLBACK_TABLE_SIZE - 1)) == 0, "CALLBACK_MAX must be a power of two");
+	static_assert(CALLBACK_MAX < 0xFF, "CALLBACK_MAX must be lower than 255");
+
+	struct Node {
+		uint32_t		hash;
+		uint16_t		key;		// offset of data string in text buffer
+		CallbackType	callback;
+	};
+
+	uint8_t		m_table[CALLBACK_TABLE_SIZE];	// node index + 1 (0 = empty slot)
+	Node		m_nodes[CALLBACK_MAX];
+	uint8_t		m_count = 0;
+	uint16_t	m_textLength = 0;
+	char		m_text[CALLBACK_TEXT_SIZE];
+
+	static uint32_t hash(const char* data);
+
+	// returns:
+	//   the table slot that holds the key, or the empty slot where it has to be inserted
+	uint8_t find(const char* data, uint32_t hash) const;
+
+	inline bool contains(const char* data) const { return m_table[find(data, hash(data))] != 0; }
+
+	// forget the oldest callback (nodes are compacted and the table is built again)
+	void removeOldest();
+};
+
+#endif
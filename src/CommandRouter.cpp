@@ -0,0 +1,90 @@
+#include "CommandRouter.h"
+#include "Utilities.h"
+
+
+uint32_t CommandRouter::hash(const char* str, size_t len)
+{
+	return fnv1a(str, len, true);
+}
+
+
+uint8_t CommandRouter::find(const char* name, size_t len, uint32_t hash) const
+{
+	uint8_t slot = hash & (ROUTER_TABLE_SIZE - 1);
+	while (m_table[slot] != 0) {
+		const Command &cmd = m_commands[m_table[slot] - 1];
+		if (cmd.hash == hash && cmd.length == len && strncasecmp(m_text + cmd.name, name, len) == 0)
+			break;
+		slot = (slot + 1) & (ROUTER_TABLE_SIZE - 1);
+	}
+	return slot;
+}
+
+
+bool CommandRouter::add(const char* command, CommandHandler handler)
+{
+	if (command == nullptr)
+		return false;
+	if (*command == '/')
+		command++;
+	size_t len = strlen(command);
+	if (len == 0 || len > 0xFF)
+		return false;
+
+	uint32_t h = hash(command, len);
+	uint8_t slot = find(command, len, h);
+	if (m_table[slot] != 0) {
+		m_commands[m_table[slot] - 1].handler = handler;
+		return true;
+	}
+
+	if (m_count >= ROUTER_MAX_COMMANDS || m_textLength + len > ROUTER_TEXT_SIZE)
+		return false;
+
+	Command &cmd = m_commands[m_count];
+	cmd.hash = h;
+	cmd.name = m_textLength;
+	cmd.length = len;
+	cmd.handler = handler;
+	memcpy(m_text + m_textLength, command, len);		// not null terminated, length is stored
+	m_textLength += len;
+	m_table[slot] = ++m_count;
+	return true;
+}
+
+
+bool CommandRouter::dispatch(const TBMessage &msg, const char* botName) const
+{
+	const char* text = msg.text.c_str();
+	if (m_count == 0 || *text != '/')
+		return false;
+
+	// "/command@botname arguments"
+	const char* name = ++text;
+	while (*text != '\0' && *text != ' ' && *text != '@' && *text != '\n')
+		text++;
+	size_t len = text - name;
+
+	if (*text == '@') {
+		const char* bot = ++text;
+		while (*text != '\0' && *text != ' ' && *text != '\n')
+			text++;
+		if (botName == nullptr || strlen(botName) != (size_t)(text - bot) || strncasecmp(bot, botName, text - bot) != 0)
+			return false;	// this command is for another bot
+	}
+
+	if (len == 0 || len > 0xFF)
+		return false;
+	uint8_t slot = find(name, len, hash(name, len));
+	if (m_table[slot] == 0)
+		return false;
+
+	const Command &cmd = m_commands[m_table[slot] - 1];
+	if (cmd.handler == nullptr)
+		return false;
+
+	while (*text == ' ' || *text == '\n')
+		text++;
+	cmd.handler(msg, text);
+	return true;
+}
@@ -0,0 +1,70 @@
+#ifndef COMMAND_ROUTER
+#define COMMAND_ROUTER
+
+#include <Arduino.h>
+#include <functional>
+#include "DataStructures.h"
+
+#ifndef ROUTER_MAX_COMMANDS
+#define ROUTER_MAX_COMMANDS		64		// max number of commands (power of two)
+#endif
+#ifndef ROUTER_TEXT_SIZE
+#define ROUTER_TEXT_SIZE		768		// buffer for all registered command names
+#endif
+#define ROUTER_TABLE_SIZE		(ROUTER_MAX_COMMANDS * 2)
+
+
+// Dispatch "/command[@botname] arguments" text messages to the registered handlers.
+// Command names are case insensitive and are found with a single hash of the received
+// command (open addressing table with cached hashes), whatever the number of commands.
+// Arguments are passed to the handler as a pointer inside the message text (no copy).
+class CommandRouter
+{
+public:
+	// args: the text following the command, without leading spaces ("" if none)
+	using CommandHandler = std::function<void(const TBMessage &msg, const char* args)>;
+
+	CommandRouter() { memset(m_table, 0, sizeof(m_table)); }
+
+	// register (or replace) the handler of a command. Leading '/' is optional
+	// returns:
+	//   false if there isn't enough space
+	bool add(const char* command, CommandHandler handler);
+
+	// call the handler of the command contained in text, if any
+	// params:
+	//   msg    : the received message (msg.text holds the command)
+	//   botName: commands addressed to other bots ("/cmd@otherbot") are ignored
+	// returns:
+	//   true if a handler was called
+	bool dispatch(const TBMessage &msg, const char* botName) const;
+
+	// Number of registered commands
+	inline uint8_t size() const { return m_count; }
+
+private:
+	static_assert((ROUTER_TABLE_SIZE & (ROUTER_TABLE_SIZE - 1)) == 0, "ROUTER_MAX_COMMANDS must be a power of two");
+	static_assert(ROUTER_MAX_COMMANDS < 0xFF, "ROUTER_MAX_COMMANDS must be lower than 255");
+
+	struct Command {
+		uint32_t		hash;
+		uint16_t		name;		// offset of command name (without '/') in text buffer
+		uint8_t			length;
+		CommandHandler	handler;
+	};
+
+	uint8_t		m_table[ROUTER_TABLE_SIZE];		// command index + 1 (0 = empty slot)
+	Command		m_commands[ROUTER_MAX_COMMANDS];
+	uint8_t		m_count = 0;
+	uint16_t	m_textLength = 0;
+	char		m_text[ROUTER_TEXT_SIZE];
+
+	// case insensitive FNV-1a of the first len chars
+	static uint32_t hash(const char* str, size_t len);
+
+	// returns:
+	//   the table slot that holds the command, or the empty slot where it has to be inserted
+	uint8_t find(const char* name, size_t len, uint32_t hash) const;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "DataStructures.h"
+#include "Utilities.h"
+
+
+int TBText::indexOf(const char* str, unsigned int from) const
+{
+	if (from > length())
+		return -1;
+	const char* found = strstr(c_str() + from, str);
+	return found != nullptr ? found - c_str() : -1;
+}
+
+
+int TBText::indexOf(char c, unsigned int from) const
+{
+	if (from > length())
+		return -1;
+	const char* found = strchr(c_str() + from, c);
+	return found != nullptr ? found - c_str() : -1;
+}
+
+
+String TBText::substring(unsigned int from, unsigned int to) const
+{
+	unsigned int len = length();
+	if (to > len)
+		to = len;
+	if (from >= to)
+		return String();
+	String str((char *)0);
+	str.reserve(to - from);
+	str.concat(c_str() + from, to - from);
+	return str;
+}
+
+
+TBMessage& TBMessage::operator=(const TBMessage &other)
+{
+	if (this == &other)
+		return *this;
+
+	// All the fields are plain data: copy them at once, then only the used part of the buffer
+	size_t fields = other.m_buffer - (const char*) &other;
+	memcpy((void*) this, (const void*) &other, fields);
+	memcpy(m_buffer, other.m_buffer, other.m_used);
+
+	// Strings stored in the other message are moved to this buffer
+	const char* const start = other.m_buffer;
+	const char* const end = other.m_buffer + TBMESSAGE_BUFFER_SIZE;
+	const char** strings[] = {
+		&sender.firstName, &sender.lastName, &sender.username, &sender.languageCode,
+		&group.title,
+		&contact.phoneNumber, &contact.firstName, &contact.lastName, &contact.vCard,
+		&document.file_id, &document.file_name,
+		&callbackQueryData, &callbackQueryID, &text.m_str
+	};
+	for (const char** str : strings) {
+		if (*str >= start && *str < end)
+			*str = m_buffer + (*str - start);
+	}
+	return *this;
+}
+
+
+void TBMessage::clear()
+{
+	// Every field default is zero: no temporary message (and buffer) on the stack
+	size_t fields = m_buffer - (const char*) this;
+	memset((void*) this, 0, fields);
+	clearStrings();
+}
+
+
+const char* TBMessage::store(const char* str)
+{
+	if (str == nullptr)
+		return nullptr;
+	size_t space = TBMESSAGE_BUFFER_SIZE - m_used;
+	if (space == 0) {
+		truncated = *str != '\0';
+		return "";
+	}
+
+	size_t len = strlen(str);
+	if (len >= space) {
+		truncated = true;
+		len = space - 1;
+		// Don't cut an UTF-8 character
+		while (len > 0 && ((uint8_t) str[len] & 0xC0) == 0x80)
+			len--;
+	}
+	char* dest = m_buffer + m_used;
+	memcpy(dest, str, len);
+	dest[len] = '\0';
+	m_used += len + 1;
+	return dest;
+}
+
+
+void TBMessage::decodeText()
+{
+	// Only a text stored in the buffer can be changed
+	if (text.m_str >= m_buffer && text.m_str < m_buffer + m_used)
+		decodeUnicodeEscapes(m_buffer + (text.m_str - m_buffer));
+}
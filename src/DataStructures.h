@@ -3,10 +3,19 @@
 #define DATA_STRUCTURES
 
 #include <Arduino.h>
+#include <type_traits>
 
 #define BUFFER_BIG       	2048 		// json parser buffer size (ArduinoJson v6)
 #define BUFFER_MEDIUM     	1028 		// json parser buffer size (ArduinoJson v6)
 #define BUFFER_SMALL      	512 		// json parser buffer size (ArduinoJson v6)
+#define UPDATES_QUEUE_SIZE	4			// max number of updates fetched (and parsed) with a single getUpdates
+#define UPDATES_DOC_SIZE	(BUFFER_MEDIUM * UPDATES_QUEUE_SIZE)
+#ifndef TBMESSAGE_BUFFER_SIZE
+#define TBMESSAGE_BUFFER_SIZE	512		// storage for all the strings of a message (longer text is truncated, see TBMessage::truncated)
+#endif
+#ifndef TBDOCUMENT_PATH_SIZE
+#define TBDOCUMENT_PATH_SIZE	192		// file link: https://api.telegram.org/file/bot<token>/<file_path>
+#endif
 
 enum MessageType {
 	MessageNoData   = 0,
@@ -21,14 +30,9 @@ enum MessageType {
 
 // Here we store the stuff related to the Telegram server reply
 struct HttpServerReply {
-    bool        waitingReply = false;
+    volatile bool waitingReply = false;     // a getUpdates request is pending
+    volatile bool replyReady = false;       // getUpdates reply has been received and parsed
     uint32_t    timestamp;
-    String      payload;
-
-    // Task sharing variables
-    // Here we can share data with task for handling the request to server
-    String      command;
-    String      param;
 } ;
 
 
@@ -65,9 +69,45 @@ struct TBDocument {
 	const char*  file_name;
 	bool         file_exists;
 	int32_t      file_size;
-	char		 file_path[128];
+	char		 file_path[TBDOCUMENT_PATH_SIZE];
 };
 
+// Read-only text of a message, with the most used functions of String (no heap allocation)
+class TBText
+{
+public:
+	TBText(const char* str = nullptr) : m_str(str) {}
+
+	inline const char* c_str() const { return m_str != nullptr ? m_str : ""; }
+	inline operator const char*() const { return c_str(); }
+	inline unsigned int length() const { return strlen(c_str()); }
+	inline bool isEmpty() const { return *c_str() == '\0'; }
+
+	inline bool equals(const char* str) const { return strcmp(c_str(), str) == 0; }
+	inline bool equalsIgnoreCase(const char* str) const { return strcasecmp(c_str(), str) == 0; }
+	inline bool startsWith(const char* prefix) const { return strncmp(c_str(), prefix, strlen(prefix)) == 0; }
+	inline bool operator==(const char* str) const { return equals(str); }
+	inline bool operator!=(const char* str) const { return !equals(str); }
+
+	// returns:
+	//   the position of str (from index <from>), -1 if not found
+	int indexOf(const char* str, unsigned int from = 0) const;
+	int indexOf(char c, unsigned int from = 0) const;
+
+	// copy a part of the text to a new String
+	String substring(unsigned int from, unsigned int to = 0xFFFF) const;
+	inline long toInt() const { return atol(c_str()); }
+
+private:
+	const char* m_str;
+	friend struct TBMessage;
+};
+
+
+// A received message. All its strings are copied in the inline buffer of the message itself,
+// so it doesn't depend on the JSON reply anymore and can be stored, queued or passed
+// to another task. A copy never allocates memory: only the used part of the buffer is copied
+// and the string pointers are moved to the new buffer.
 struct TBMessage {
 	MessageType 	 messageType;
 	bool			 isHTMLenabled = false;
@@ -78,15 +118,42 @@ struct TBMessage {
 	int32_t          messageID;
 	int32_t          date;
 	int32_t          chatInstance;
+	bool			 truncated = false;		// some text didn't fit in TBMESSAGE_BUFFER_SIZE and has been cut
 	TBUser           sender;
 	TBGroup          group;
 	TBLocation       location;
 	TBContact        contact;
 	TBDocument       document;
-	const char*      callbackQueryData;
-	const char*   	 callbackQueryID;
-	String      	 text;
+	const char*      callbackQueryData = nullptr;
+	const char*   	 callbackQueryID = nullptr;
+	TBText      	 text;
+
+	TBMessage() {}
+	TBMessage(const TBMessage &other) { *this = other; }
+	TBMessage& operator=(const TBMessage &other);
+
+	// copy a string in the message buffer (truncated if there isn't enough space)
+	// returns:
+	//   the stored string, nullptr if str is nullptr
+	const char* store(const char* str);
+
+	// forget all the stored strings
+	inline void clearStrings() { m_used = 0; }
+
+	// reset all the fields and the stored strings, in place (same as assigning TBMessage())
+	void clear();
+
+	// decode the \uXXXX sequences written in the text (see enableUTF8Encoding()), in place
+	void decodeText();
+
+private:
+	uint16_t		m_used = 0;
+	char			m_buffer[TBMESSAGE_BUFFER_SIZE];		// must be the last member
 };
 
-#endif
+static_assert(TBMESSAGE_BUFFER_SIZE <= 0xFFFF, "TBMESSAGE_BUFFER_SIZE must fit in 16 bits");
+static_assert(std::is_trivially_destructible<TBMessage>::value, "TBMessage must not own heap memory");
+static_assert(std::is_trivially_copyable<TBText>::value, "TBText must be a plain pointer");
+static_assert(sizeof(TBMessage) <= TBMESSAGE_BUFFER_SIZE + TBDOCUMENT_PATH_SIZE + 192, "TBMessage fixed fields are too big");
 
+#endif
@@ -0,0 +1,155 @@
+#ifndef DOUBLE_BUFFER
+#define DOUBLE_BUFFER
+
+#include <Arduino.h>
+
+#if defined(ESP32)
+
+// Two buffers passed between the calling task and a worker task, so that one buffer is filled
+// while the other one is emptied (i.e. file read while the previous block is sent to server,
+// or flash written while the next block is downloaded).
+// The worker either fills the buffers (caller gets them with receive() and gives them back
+// with release()) or empties them (caller gets them with acquire() and hands them with submit()).
+// A block with len 0 marks the end of the data.
+class DoubleBuffer
+{
+public:
+	// called in the worker task for each block
+	// params
+	//   context: the pointer passed to begin()
+	//   buffer : the block
+	//   len    : bytes in the block (worker empties) or size of the buffer (worker fills)
+	// returns
+	//   bytes written in the buffer when the worker fills it (0: no more data)
+	using Worker = size_t (*)(void* context, uint8_t* buffer, size_t len);
+
+	struct Block {
+		uint8_t index;
+		size_t  len;
+	};
+
+	DoubleBuffer(size_t size) : m_size(size) {}
+
+	~DoubleBuffer() {
+		end();
+		free(m_buffer[0]);
+		free(m_buffer[1]);
+		if (m_freeQueue) vQueueDelete(m_freeQueue);
+		if (m_fullQueue) vQueueDelete(m_fullQueue);
+	}
+
+	// allocate the buffers and start the worker task
+	// params
+	//   name   : the name of the worker task
+	//   fills  : true if the worker fills the buffers, false if it empties them
+	//   worker : the function called for each block
+	//   context: passed to worker
+	// returns
+	//   false if there is not enough memory
+	bool begin(const char* name, bool fills, Worker worker, void* context) {
+		m_fills = fills;
+		m_worker = worker;
+		m_context = context;
+		m_buffer[0] = (uint8_t*) malloc(m_size);
+		m_buffer[1] = (uint8_t*) malloc(m_size);
+		m_freeQueue = xQueueCreate(2, sizeof(uint8_t));
+		m_fullQueue = xQueueCreate(2, sizeof(Block));
+		if (!m_buffer[0] || !m_buffer[1] || !m_freeQueue || !m_fullQueue)
+			return false;
+		for (uint8_t i = 0; i < 2; i++)
+			xQueueSend(m_freeQueue, &i, 0);
+		m_owner = xTaskGetCurrentTaskHandle();
+		m_running = xTaskCreate(workerTask, name, 3072, this, 5, NULL) == pdPASS;
+		return m_running;
+	}
+
+	inline uint8_t* buffer(uint8_t index) const { return m_buffer[index]; }
+
+	// wait for a buffer to fill (worker empties)
+	inline uint8_t acquire() {
+		uint8_t index;
+		xQueueReceive(m_freeQueue, &index, portMAX_DELAY);
+		return index;
+	}
+
+	// hand a filled buffer to the worker
+	inline void submit(uint8_t index, size_t len) {
+		Block block = { index, len };
+		xQueueSend(m_fullQueue, &block, portMAX_DELAY);
+	}
+
+	// wait for a block filled by the worker (len 0: worker has finished)
+	inline Block receive() {
+		Block block;
+		xQueueReceive(m_fullQueue, &block, portMAX_DELAY);
+		if (block.len == 0)
+			m_ended = true;
+		return block;
+	}
+
+	// give a block back to the worker once its content has been used
+	inline void release(uint8_t index) {
+		xQueueSend(m_freeQueue, &index, portMAX_DELAY);
+	}
+
+	// stop feeding the worker with data: it gets only empty blocks from now on
+	inline void abort() { m_abort = true; }
+
+	// wait until the worker has handled all the blocks and terminated
+	void end() {
+		if (!m_running)
+			return;
+		if (m_fills) {
+			// Worker stops filling at the next block
+			m_abort = true;
+			while (!m_ended)
+				release(receive().index);
+		}
+		else
+			submit(0, 0);
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		m_running = false;
+	}
+
+private:
+	static void workerTask(void *args) {
+		DoubleBuffer *pipe = (DoubleBuffer *) args;
+		Block block;
+		for(;;) {
+			if (pipe->m_fills) {
+				xQueueReceive(pipe->m_freeQueue, &block.index, portMAX_DELAY);
+				block.len = pipe->m_abort ? 0 : pipe->m_worker(pipe->m_context, pipe->m_buffer[block.index], pipe->m_size);
+				xQueueSend(pipe->m_fullQueue, &block, portMAX_DELAY);
+				if (block.len == 0)
+					break;
+			}
+			else {
+				xQueueReceive(pipe->m_fullQueue, &block, portMAX_DELAY);
+				if (block.len == 0)
+					break;
+				if (!pipe->m_abort)
+					pipe->m_worker(pipe->m_context, pipe->m_buffer[block.index], block.len);
+				xQueueSend(pipe->m_freeQueue, &block.index, portMAX_DELAY);
+			}
+		}
+		// pipe lives in the owner task stack: don't touch it after notification
+		TaskHandle_t owner = pipe->m_owner;
+		xTaskNotifyGive(owner);
+		vTaskDelete(NULL);
+	}
+
+	size_t          m_size;
+	uint8_t         *m_buffer[2] = { nullptr, nullptr };
+	QueueHandle_t   m_freeQueue = nullptr;      // indexes of buffers ready to be filled
+	QueueHandle_t   m_fullQueue = nullptr;      // blocks ready to be emptied
+	TaskHandle_t    m_owner = nullptr;
+	Worker          m_worker = nullptr;
+	void            *m_context = nullptr;
+	bool            m_fills = false;
+	bool            m_running = false;
+	bool            m_ended = false;            // end block received from a filling worker
+	volatile bool   m_abort = false;
+};
+
+#endif
+#endif
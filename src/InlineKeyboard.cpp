@@ -4,7 +4,6 @@
 
 InlineKeyboard::InlineKeyboard()
 {
-	m_json = "{\"inline_keyboard\":[[]]}\"";
 
 }
 
@@ -13,16 +12,7 @@ InlineKeyboard::~InlineKeyboard(){}
 
 bool InlineKeyboard::addRow()
 {
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 128);	 // Current size + space for new row (empty)
-	deserializeJson(doc, m_json);
-	JsonArray  rows = doc["inline_keyboard"];	
-	rows.createNestedArray();
-	m_json.clear();
-	serializeJson(doc, m_json);
-	doc.shrinkToFit();
-	m_jsonSize = doc.memoryUsage();
-	return true;
+	return KeyboardLayout::addRow();
 }
 
 
@@ -30,71 +20,45 @@ bool InlineKeyboard::addButton(const char* text, const char* command, InlineKeyb
 {
 	if ((buttonType != KeyboardButtonURL) && (buttonType != KeyboardButtonQuery))
 		return false;
-	
-	InlineButton *inlineButton = new InlineButton();
-	if (_firstButton == nullptr) 
-		_firstButton = inlineButton;
-	else
-		_lastButton->nextButton = inlineButton;
-	inlineButton->argCallback = onClick;
-	inlineButton->btnName = (char*)command;
-	_lastButton = inlineButton;
-	m_buttonsCounter++;
-	
-	// As reccomended use local JsonDocument instead global
-	// inline keyboard json structure will be stored in a String var
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 256);	 // Current size + space for new object (button)
-	deserializeJson(doc, m_json);
-
-	JsonArray  rows = doc["inline_keyboard"];	
-	JsonObject button = rows[rows.size()-1].createNestedObject();
-
-	button["text"] = text ; 
-	if(KeyboardButtonURL == buttonType) 
-		button["url"] = command;	
-	else if (KeyboardButtonQuery == buttonType) 		
-		button["callback_data"] = command;	
-
-	// Store inline keyboard json structure
-	m_json.clear();
-	serializeJson(doc, m_json);
-	doc.shrinkToFit();
-	m_jsonSize = doc.memoryUsage();
+	// Inline buttons always have an url or a callback data
+	if (command == nullptr)
+		return false;
+
+	// Button is stored in the compact layout, JSON will be generated only when needed
+	int16_t index = KeyboardLayout::addButton(text, command, buttonType);
+	if (index < 0)
+		return false;
+	m_callbacks[index] = onClick;
 	return true;	
 }
 
 
-// Check if a callback function has to be called for this button query message
-void InlineKeyboard::checkCallback( const TBMessage &msg)  {
-	char* buttonName = (char*) msg.callbackQueryData;
-	for(InlineButton *_button = _firstButton; _button != nullptr; _button = _button->nextButton){
-		if( strstr(_button->btnName, buttonName) != nullptr && _button->argCallback != nullptr)	
-			_button->argCallback(msg);
-	}
-} 
+void InlineKeyboard::writeJSON(JsonWriter &out) const
+{
+	writeRows(out, "inline_keyboard");
+	out.raw('}');
+}
 
 
-// Get total number of keyboard buttons
-int InlineKeyboard::getButtonsNumber() 
+void InlineKeyboard::writeButton(JsonWriter &out, const KeyboardButton &button) const
 {
-	return m_buttonsCounter;
+	out.raw(button.type == KeyboardButtonURL ? ",\"url\":" : ",\"callback_data\":");
+	out.quoted(getText(button.data));
 }
 
 
-
 String InlineKeyboard::getJSON() const
 {
-	return m_json;
+	return buildJSON();
 }
 
 
 String InlineKeyboard::getJSONPretty() const
 {
-	uint16_t jsonSize;
-	if(m_jsonSize < BUFFER_SMALL) jsonSize = BUFFER_SMALL;	
-	DynamicJsonDocument doc(jsonSize + 128);	// Current size + space for new lines
-	deserializeJson(doc, m_json);
+	// Only for debug prints, never called by the library: a keyboard doesn't know the bot arena,
+	// so this temporary document is taken from the heap
+	DynamicJsonDocument doc(measureJSON() * 2 + 128);	// Current size + space for parsed structure
+	deserializeJson(doc, buildJSON());
 	
 	String serialized;		
 	serializeJsonPretty(doc, serialized);
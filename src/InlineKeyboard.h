@@ -1,4 +1,3 @@
-
 #ifndef INLINE_KEYBOARD
 #define INLINE_KEYBOARD
 
@@ -6,6 +5,7 @@
 #include <functional>
 #include <ArduinoJson.h>
 #include "DataStructures.h"
+#include "KeyboardLayout.h"
 
 enum InlineKeyboardButtonType {
 	KeyboardButtonURL    = 1,
@@ -15,26 +15,16 @@ enum InlineKeyboardButtonType {
 
 
 
-class InlineKeyboard
+class InlineKeyboard : public KeyboardLayout
 {
 
-using CallbackType = std::function<void(const TBMessage &msg)>;
-
-struct InlineButton{
-	char 		*btnName;
-	CallbackType argCallback;
-	InlineButton *nextButton;
-} ;
-
-
 public:
+	using CallbackType = std::function<void(const TBMessage &msg)>;
+
 	InlineKeyboard();
 	~InlineKeyboard();
 
 
-	// Get total number of keyboard buttons
-	int getButtonsNumber() ;
-
 	// add a new empty row of buttons
 	// return:
 	//    true if no error occurred
@@ -58,20 +48,12 @@ public:
 
 
 private:
-	friend class AsyncTelegram;
-
-	String 			m_json;
-	String 			m_name;
-	size_t 			m_jsonSize = BUFFER_MEDIUM;
-
-	uint8_t			m_buttonsCounter = 0;
-	InlineButton 	*_firstButton = nullptr;
-	InlineButton 	*_lastButton = nullptr;
-
+	friend class CallbackRegistry;
 
-	// Check if a callback function has to be called for a button query reply message
-	void checkCallback(const TBMessage &msg) ;
+	CallbackType	m_callbacks[KEYBOARD_MAX_BUTTONS];
 
+	void writeJSON(JsonWriter &out) const override;
+	void writeButton(JsonWriter &out, const KeyboardButton &button) const override;
 
 };
 
@@ -0,0 +1,121 @@
+#include "JsonArena.h"
+
+
+int8_t JsonArena::find(void* ptr) const
+{
+	size_t start = (uint8_t*) ptr - m_buffer;
+	for (int8_t i = m_count - 1; i >= 0; i--) {
+		if (m_blocks[i].start == start)
+			return i;
+	}
+	return -1;
+}
+
+
+void* JsonArena::allocate(size_t size)
+{
+	lock();
+	void* ptr = take(size);
+	unlock();
+	// Arena is full: memory from the heap (outside the critical section)
+	return ptr != nullptr ? ptr : malloc(size);
+}
+
+
+void* JsonArena::take(size_t size)
+{
+	m_allocations++;
+	size_t start = (m_top + 7) & ~(size_t) 7;		// 8 bytes aligned block
+	if (m_count == JSON_ARENA_BLOCKS || start + size > JSON_ARENA_SIZE) {
+		m_fallbacks++;
+		return nullptr;
+	}
+
+	Block &block = m_blocks[m_count++];
+	block.previousTop = m_top;
+	block.start = start;
+	block.end = start + size;
+	block.released = false;
+	m_top = block.end;
+	if (m_top > m_highWater)
+		m_highWater = m_top;
+	return m_buffer + start;
+}
+
+
+void JsonArena::deallocate(void* ptr)
+{
+	if (ptr == nullptr)
+		return;
+	if (!owns(ptr)) {
+		free(ptr);
+		return;
+	}
+	lock();
+	release(ptr);
+	unlock();
+}
+
+
+void JsonArena::release(void* ptr)
+{
+	int8_t index = find(ptr);
+	if (index < 0)
+		return;
+	m_blocks[index].released = true;
+
+	// Space is given back when the blocks on the top are released
+	while (m_count > 0 && m_blocks[m_count - 1].released) {
+		m_count--;
+		m_top = m_blocks[m_count].previousTop;
+	}
+}
+
+
+void* JsonArena::reallocate(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return allocate(size);
+	if (!owns(ptr))
+		return realloc(ptr, size);
+
+	lock();
+	int8_t index = find(ptr);
+	if (index < 0) {
+		unlock();
+		return nullptr;
+	}
+
+	// The block on the top can just change its size
+	Block &block = m_blocks[index];
+	if (index == m_count - 1 && block.start + size <= JSON_ARENA_SIZE) {
+		block.end = block.start + size;
+		m_top = block.end;
+		if (m_top > m_highWater)
+			m_highWater = m_top;
+		unlock();
+		return ptr;
+	}
+	size_t oldSize = block.end - block.start;
+	unlock();
+
+	// The old block still belongs to the caller: it can be copied without the lock
+	void* newPtr = allocate(size);
+	if (newPtr != nullptr) {
+		memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+		deallocate(ptr);
+	}
+	return newPtr;
+}
+
+
+JsonArena::Stats JsonArena::stats() const
+{
+	Stats stats;
+	stats.capacity = JSON_ARENA_SIZE;
+	stats.used = m_top;
+	stats.highWater = m_highWater;
+	stats.allocations = m_allocations;
+	stats.fallbacks = m_fallbacks;
+	return stats;
+}
@@ -0,0 +1,97 @@
+#ifndef JSON_ARENA
+#define JSON_ARENA
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "DataStructures.h"
+
+#ifndef JSON_ARENA_SIZE
+// getUpdates document (always allocated) + the largest temporary documents (filter and reply of an upload)
+#define JSON_ARENA_SIZE		(UPDATES_DOC_SIZE + BUFFER_SMALL + BUFFER_MEDIUM + 64)
+#endif
+#ifndef JSON_ARENA_BLOCKS
+#define JSON_ARENA_BLOCKS	8		// max number of documents allocated at the same time
+#endif
+
+
+// Fixed memory area for all the JSON documents of the library.
+// Blocks are taken from the top of the arena and released in reverse order (documents are
+// scoped), so the heap is never used in steady state. If the arena is full, the block is taken
+// from the heap and counted in stats.
+// On ESP32 documents are created both by httpPostTask and by the loop task: blocks of the two tasks
+// can be interleaved, so a block released out of order is only marked and its space is given back
+// with the blocks above it. The block table is guarded by a spinlock.
+class JsonArena
+{
+public:
+	struct Stats {
+		size_t		capacity;
+		size_t		used;
+		size_t		highWater;		// max bytes used since start
+		uint32_t	allocations;
+		uint32_t	fallbacks;		// allocations served by the heap (arena full)
+	};
+
+	void* allocate(size_t size);
+	void deallocate(void* ptr);
+	void* reallocate(void* ptr, size_t size);
+
+	Stats stats() const;
+
+private:
+	struct Block {
+		size_t	previousTop;
+		size_t	start;
+		size_t	end;
+		bool	released;
+	};
+
+	alignas(8) uint8_t m_buffer[JSON_ARENA_SIZE];
+	Block		m_blocks[JSON_ARENA_BLOCKS];
+	uint8_t		m_count = 0;
+	size_t		m_top = 0;
+	size_t		m_highWater = 0;
+	uint32_t	m_allocations = 0;
+	uint32_t	m_fallbacks = 0;
+#if defined(ESP32)
+	portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+	// allocate() and deallocate() of a block in the arena, with the lock held
+	void* take(size_t size);
+	void release(void* ptr);
+
+	inline void lock() {
+#if defined(ESP32)
+		portENTER_CRITICAL(&m_lock);
+#endif
+	}
+	inline void unlock() {
+#if defined(ESP32)
+		portEXIT_CRITICAL(&m_lock);
+#endif
+	}
+
+	// returns:
+	//   the index of the block that starts at ptr, -1 if not found
+	int8_t find(void* ptr) const;
+
+	inline bool owns(void* ptr) const {
+		return (uint8_t*) ptr >= m_buffer && (uint8_t*) ptr < m_buffer + JSON_ARENA_SIZE;
+	}
+};
+
+
+// ArduinoJson allocator that takes memory from a JsonArena
+struct ArenaAllocator {
+	JsonArena* arena;
+
+	ArenaAllocator(JsonArena* arena = nullptr) : arena(arena) {}
+	void* allocate(size_t size) { return arena != nullptr ? arena->allocate(size) : malloc(size); }
+	void deallocate(void* ptr) { if (arena != nullptr) arena->deallocate(ptr); else free(ptr); }
+	void* reallocate(void* ptr, size_t size) { return arena != nullptr ? arena->reallocate(ptr, size) : realloc(ptr, size); }
+};
+
+using ArenaJsonDocument = BasicJsonDocument<ArenaAllocator>;
+
+#endif
@@ -0,0 +1,237 @@
+#include "KeyboardLayout.h"
+#include "Utilities.h"
+
+
+void JsonWriter::raw(const char* text)
+{
+	size_t len = strlen(text);
+	if (m_str != nullptr)
+		*m_str += text;
+	else if (m_print != nullptr)
+		m_print->write((const uint8_t*) text, len);
+	m_length += len;
+}
+
+
+void JsonWriter::raw(const char* text, size_t len)
+{
+	if (m_str != nullptr)
+		m_str->concat(text, len);
+	else if (m_print != nullptr)
+		m_print->write((const uint8_t*) text, len);
+	m_length += len;
+}
+
+
+void JsonWriter::number(int64_t value)
+{
+	char buffer[21];
+	raw(buffer, int64ToChars(value, buffer));
+}
+
+
+void JsonWriter::object(const char* json, const char* fields)
+{
+	const char* end = fields != nullptr ? strrchr(json, '}') : nullptr;
+	if (end == nullptr) {
+		raw(json);
+		return;
+	}
+	raw(json, end - json);
+	// An empty object doesn't need the separator
+	const char* last = end;
+	while (last > json && isspace((uint8_t) last[-1]))
+		last--;
+	if (last > json && last[-1] != '{')
+		raw(',');
+	raw(fields);
+	raw('}');
+}
+
+
+void JsonWriter::raw(char c)
+{
+	if (m_str != nullptr)
+		*m_str += c;
+	else if (m_print != nullptr)
+		m_print->write((uint8_t) c);
+	m_length++;
+}
+
+
+void JsonWriter::escapedChar(char c)
+{
+	switch (c) {
+		case '"':	raw("\\\"");	break;
+		case '\\':	raw("\\\\");	break;
+		case '\n':	raw("\\n");		break;
+		case '\r':	raw("\\r");		break;
+		case '\t':	raw("\\t");		break;
+		default:
+			if ((uint8_t) c < 0x20) {
+				char escaped[7];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", (uint8_t) c);
+				raw(escaped);
+			}
+			else
+				raw(c);
+	}
+}
+
+
+void JsonWriter::escaped(const char* text, size_t len, TextEscape mode)
+{
+	const char* run = text;
+	const char* end = text + len;
+	for (const char* c = text; c < end; c++) {
+		const char* sequence = escapeChar(*c, mode);
+		if (sequence == nullptr && *c != '"' && *c != '\\' && (uint8_t) *c >= 0x20)
+			continue;
+		raw(run, c - run);
+		run = c + 1;
+		if (sequence == nullptr)
+			escapedChar(*c);
+		else {
+			// The escape sequence can contain JSON reserved characters too (i.e. '\')
+			for (const char* s = sequence; *s != '\0'; s++)
+				escapedChar(*s);
+		}
+	}
+	raw(run, end - run);
+}
+
+
+void JsonWriter::quoted(const char* text, TextEscape mode)
+{
+	raw('"');
+	escaped(text, strlen(text), mode);
+	raw('"');
+}
+
+
+void JsonWriter::quotedFormat(const char* format, const char* const* args, size_t count, TextEscape mode)
+{
+	raw('"');
+	size_t arg = 0;
+	const char* run = format;
+	for (const char* c = format; *c != '\0'; c++) {
+		if (c[0] != '%' || (c[1] != 's' && c[1] != '%') || (c[1] == 's' && arg >= count))
+			continue;
+		escaped(run, c - run, EscapeNone);
+		if (c[1] == '%')
+			raw('%');
+		else {
+			const char* value = args[arg++];
+			if (value != nullptr)
+				escaped(value, strlen(value), mode);
+		}
+		c++;
+		run = c + 1;
+	}
+	escaped(run, strlen(run), EscapeNone);
+	raw('"');
+}
+
+
+uint16_t KeyboardLayout::storeText(const char* text)
+{
+	size_t len = strlen(text) + 1;
+	if (m_textLength + len > KEYBOARD_TEXT_SIZE)
+		return KEYBOARD_NO_DATA;
+	uint16_t offset = m_textLength;
+	memcpy(m_text + offset, text, len);
+	m_textLength += len;
+	return offset;
+}
+
+
+bool KeyboardLayout::addRow()
+{
+	if (m_rowsCount == 0xFF)
+		return false;
+	m_rowsCount++;
+	invalidate();
+	return true;
+}
+
+
+int16_t KeyboardLayout::addButton(const char* text, const char* data, uint8_t type)
+{
+	if (m_buttonsCount >= KEYBOARD_MAX_BUTTONS || text == nullptr)
+		return -1;
+
+	uint16_t textLength = m_textLength;
+	KeyboardButton &button = m_buttons[m_buttonsCount];
+	button.text = storeText(text);
+	button.data = data != nullptr ? storeText(data) : KEYBOARD_NO_DATA;
+	if (button.text == KEYBOARD_NO_DATA || (data != nullptr && button.data == KEYBOARD_NO_DATA)) {
+		m_textLength = textLength;		// rollback
+		return -1;
+	}
+	button.row = m_rowsCount - 1;
+	button.type = type;
+	invalidate();
+	return m_buttonsCount++;
+}
+
+
+void KeyboardLayout::writeRows(JsonWriter &out, const char* name) const
+{
+	out.raw("{\"");
+	out.raw(name);
+	out.raw("\":[");
+	uint8_t btn = 0;
+	for (uint8_t row = 0; row < m_rowsCount; row++) {
+		if (row > 0)
+			out.raw(',');
+		out.raw('[');
+		// Buttons are stored in row order
+		for (bool first = true; btn < m_buttonsCount && m_buttons[btn].row == row; btn++, first = false) {
+			if (!first)
+				out.raw(',');
+			out.raw("{\"text\":");
+			out.quoted(getText(m_buttons[btn].text));
+			writeButton(out, m_buttons[btn]);
+			out.raw('}');
+		}
+		out.raw(']');
+	}
+	out.raw(']');
+}
+
+
+const String& KeyboardLayout::buildJSON() const
+{
+	if (!m_jsonValid) {
+		m_json.clear();
+		m_json.reserve(measureJSON());
+		JsonWriter out(m_json);
+		writeJSON(out);
+		m_jsonValid = true;
+	}
+	return m_json;
+}
+
+
+size_t KeyboardLayout::measureJSON() const
+{
+	if (m_jsonValid)
+		return m_json.length();
+	JsonWriter out;
+	writeJSON(out);
+	return out.length();
+}
+
+
+size_t KeyboardLayout::printJSON(Print &out) const
+{
+	JsonWriter writer(out);
+	writeJSON(writer);
+	return writer.length();
+}
+
+
+void KeyboardLayout::appendJSON(JsonWriter &out, const char* fields) const
+{
+	out.object(buildJSON().c_str(), fields);
+}
@@ -0,0 +1,143 @@
+#ifndef KEYBOARD_LAYOUT
+#define KEYBOARD_LAYOUT
+
+#include <Arduino.h>
+#include "Utilities.h"
+
+#ifndef KEYBOARD_MAX_BUTTONS
+#define KEYBOARD_MAX_BUTTONS	32		// max number of buttons for each keyboard
+#endif
+#ifndef KEYBOARD_TEXT_SIZE
+#define KEYBOARD_TEXT_SIZE		640		// buffer for all buttons labels and data of a keyboard
+#endif
+#define KEYBOARD_NO_DATA		0xFFFF
+
+
+// Minimal JSON text output: write to a String, to a Print (i.e. the client) or just count the bytes
+class JsonWriter
+{
+public:
+	JsonWriter() {}
+	JsonWriter(String &str) : m_str(&str) {}
+	JsonWriter(Print &print) : m_print(&print) {}
+
+	// write text as-is
+	void raw(const char* text);
+	void raw(const char* text, size_t len);
+	void raw(char c);
+
+	// write an integer value
+	void number(int64_t value);
+
+	// write a JSON object as-is, adding some fields before its closing brace
+	// params:
+	//   json  : the JSON object text
+	//   fields: the fields to add (i.e. "\"a\":1"), nullptr for none
+	void object(const char* json, const char* fields = nullptr);
+
+	// write a JSON string value (quoted and escaped)
+	// params:
+	//   text: the string value
+	//   mode: escape also the reserved characters of a message parse mode
+	void quoted(const char* text, TextEscape mode = EscapeNone);
+
+	// write a JSON string value from a template: each %s is replaced by the next argument, escaped
+	// for the parse mode (the template itself is not), %% is a single '%'
+	// params:
+	//   format: the template
+	//   args  : the arguments (nullptr is an empty string)
+	//   count : number of arguments
+	//   mode  : the parse mode of the arguments
+	void quotedFormat(const char* format, const char* const* args, size_t count, TextEscape mode);
+
+	// number of bytes written
+	inline size_t length() const { return m_length; }
+
+private:
+	// write a part of a text JSON-escaped (without quotes); plain characters are written in runs
+	void escaped(const char* text, size_t len, TextEscape mode);
+
+	// write a single character JSON-escaped
+	void escapedChar(char c);
+
+	String	*m_str = nullptr;
+	Print	*m_print = nullptr;
+	size_t	m_length = 0;
+};
+
+
+struct KeyboardButton {
+	uint16_t text;		// offset of the label in text buffer
+	uint16_t data;		// offset of url/callback data in text buffer (KEYBOARD_NO_DATA if not used)
+	uint8_t  row;
+	uint8_t  type;
+};
+
+
+// Buttons of a keyboard stored as a compact list of offsets into a single text buffer.
+// JSON is generated only when needed, in a single pass.
+class KeyboardLayout
+{
+public:
+	// Get total number of keyboard buttons
+	inline int getButtonsNumber() const { return m_buttonsCount; }
+
+	// number of bytes of JSON keyboard (i.e. for the Content-Length header)
+	size_t measureJSON() const;
+
+	// write JSON keyboard directly to an output (i.e. the client)
+	// returns:
+	//   the number of bytes written
+	size_t printJSON(Print &out) const;
+
+	// write the JSON keyboard (generated only once) as part of a request
+	// params:
+	//   fields: more fields for the keyboard object (i.e. "\"force_reply\":true"), nullptr for none
+	void appendJSON(JsonWriter &out, const char* fields = nullptr) const;
+
+protected:
+	KeyboardLayout() {}
+
+	// add a new empty row of buttons
+	bool addRow(void);
+
+	// add a button to the current row
+	// returns:
+	//   index of the new button or -1 if there isn't enough space
+	int16_t addButton(const char* text, const char* data, uint8_t type);
+
+	// returns:
+	//   the stored string, an empty string for KEYBOARD_NO_DATA
+	inline const char* getText(uint16_t offset) const { return offset != KEYBOARD_NO_DATA ? m_text + offset : ""; }
+
+	// generate the keyboard JSON (m_json is used as cache until the keyboard is changed)
+	const String& buildJSON() const;
+
+	// write "{<name>:[[{button},...],...]" (the closing brace is written by the caller)
+	void writeRows(JsonWriter &out, const char* name) const;
+
+	// write the whole keyboard JSON
+	virtual void writeJSON(JsonWriter &out) const = 0;
+
+	// write the fields of a button after "text"
+	virtual void writeButton(JsonWriter &out, const KeyboardButton &button) const = 0;
+
+	inline void invalidate() { m_jsonValid = false; }
+
+	KeyboardButton	m_buttons[KEYBOARD_MAX_BUTTONS];
+	uint8_t			m_buttonsCount = 0;
+	uint8_t			m_rowsCount = 1;
+	uint16_t		m_textLength = 0;
+	char			m_text[KEYBOARD_TEXT_SIZE];
+
+	mutable String	m_json;
+	mutable bool	m_jsonValid = false;
+
+private:
+	// store a string in text buffer
+	// returns:
+	//   the offset of stored string or KEYBOARD_NO_DATA if there isn't enough space
+	uint16_t storeText(const char* text);
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "LogBuffer.h"
+
+bool		LogBuffer::s_enabled = false;
+LogBuffer::Record* LogBuffer::s_records = nullptr;
+uint16_t	LogBuffer::s_size = 0;
+std::atomic<uint32_t> LogBuffer::s_head(0);
+
+static const char levelLetters[] = "-EID";
+
+
+bool LogBuffer::begin(uint16_t records)
+{
+	if (s_records == nullptr && records > 0) {
+		s_records = (Record*) calloc(records, sizeof(Record));
+		if (s_records == nullptr)
+			return false;
+		s_size = records;
+	}
+	s_enabled = s_records != nullptr;
+	return s_enabled;
+}
+
+
+void LogBuffer::clear()
+{
+	s_head.store(0);
+}
+
+
+void LogBuffer::push(uint8_t level, const char* format, const uint32_t* args, uint8_t argc)
+{
+	if (s_records == nullptr)
+		return;
+	// Each writer gets its own slot: no lock needed between tasks
+	Record &record = s_records[s_head.fetch_add(1) % s_size];
+	record.time = millis();
+	record.format = format;
+	record.level = level;
+	record.argc = argc < LOG_MAX_ARGS ? argc : LOG_MAX_ARGS;
+	memcpy(record.args, args, record.argc * sizeof(uint32_t));
+}
+
+
+size_t LogBuffer::printRecord(Print &out, const Record &record)
+{
+	char buffer[32];
+	size_t n = snprintf(buffer, sizeof(buffer), "[%c][%u] ",
+						levelLetters[record.level < 4 ? record.level : 0], (unsigned) record.time);
+	out.write((const uint8_t*) buffer, n);
+
+	uint8_t arg = 0;
+	for (const char* c = record.format; *c != '\0'; c++) {
+		if (*c != '%') {
+			n += out.write((uint8_t) *c);
+			continue;
+		}
+		if (c[1] == '%') {
+			n += out.write((uint8_t) '%');
+			c++;
+			continue;
+		}
+		// Copy the conversion specification (flags, width, precision, length) to format one value
+		char spec[16];
+		uint8_t len = 0;
+		spec[len++] = *c++;
+		while (*c != '\0' && strchr("diouxXcsfp", *c) == nullptr && len < sizeof(spec) - 2)
+			spec[len++] = *c++;
+		if (*c == '\0')
+			break;
+		char type = *c;
+		// Arguments are stored as 32 bits values: remove length modifiers
+		while (len > 1 && strchr("hlLqjzt", spec[len - 1]) != nullptr)
+			len--;
+		spec[len++] = type;
+		spec[len] = '\0';
+
+		uint32_t value = arg < record.argc ? record.args[arg] : 0;
+		arg++;
+		switch (type) {
+			case 's':
+				n += out.print("<str>");
+				break;
+			case 'f': {
+				float f;
+				memcpy(&f, &value, sizeof(f));
+				n += out.write((const uint8_t*) buffer, snprintf(buffer, sizeof(buffer), spec, (double) f));
+				break;
+			}
+			case 'd': case 'i': case 'c':
+				n += out.write((const uint8_t*) buffer, snprintf(buffer, sizeof(buffer), spec, (int) value));
+				break;
+			case 'p':
+				n += out.write((const uint8_t*) buffer, snprintf(buffer, sizeof(buffer), "0x%08x", (unsigned) value));
+				break;
+			default:
+				n += out.write((const uint8_t*) buffer, snprintf(buffer, sizeof(buffer), spec, (unsigned) value));
+				break;
+		}
+	}
+	return n;
+}
+
+
+size_t LogBuffer::print(Print &out)
+{
+	if (s_records == nullptr)
+		return 0;
+	uint32_t head = s_head.load();
+	uint32_t first = head > s_size ? head - s_size : 0;
+	size_t n = 0;
+	for (uint32_t i = first; i < head; i++)
+		n += printRecord(out, s_records[i % s_size]);
+	return n;
+}
+
+
+size_t LogBuffer::dump(Print &out)
+{
+	if (s_records == nullptr)
+		return 0;
+	uint32_t head = s_head.load();
+	uint32_t first = head > s_size ? head - s_size : 0;
+	size_t n = 0;
+	for (uint32_t i = first; i < head; i++)
+		n += out.write((const uint8_t*) &s_records[i % s_size], sizeof(Record));
+	return n;
+}
@@ -0,0 +1,84 @@
+#ifndef LOG_BUFFER
+#define LOG_BUFFER
+
+#include <Arduino.h>
+#include <atomic>
+#include <type_traits>
+
+#define LOG_MAX_ARGS		4		// arguments stored for each record (others are lost)
+
+
+// Deferred logging: instead of printing to Serial, each log call stores a compact binary record
+// in a RAM ring buffer (timestamp, level, address of the format string and raw arguments).
+// Records are formatted later, only when requested, or dumped as-is and decoded on a PC
+// (format addresses can be resolved with the firmware .elf file).
+// String arguments are not stored (the pointed text could be gone when the record is formatted).
+class LogBuffer
+{
+public:
+	struct Record {
+		uint32_t	time;
+		const char*	format;
+		uint8_t		level;
+		uint8_t		argc;
+		uint32_t	args[LOG_MAX_ARGS];
+	};
+
+	// start storing log records instead of printing them (buffer is allocated once)
+	// params:
+	//   records: number of records kept (oldest are overwritten)
+	// returns:
+	//   false if there isn't enough memory
+	static bool begin(uint16_t records = 64);
+
+	// go back to Serial output
+	static inline void end() { s_enabled = false; }
+
+	static inline bool enabled() { return s_enabled; }
+
+	// store a log record (from log_xxx macros)
+	template <typename... Args>
+	static void write(uint8_t level, const char* format, Args... args) {
+		uint32_t values[] = { toArg(args)..., 0 };
+		push(level, format, values, sizeof...(Args));
+	}
+
+	// format all the stored records as text
+	// returns:
+	//   the number of bytes written
+	static size_t print(Print &out);
+
+	// write all the stored records in binary form (oldest first)
+	static size_t dump(Print &out);
+
+	// forget all the stored records
+	static void clear();
+
+private:
+	static bool			s_enabled;
+	static Record*		s_records;
+	static uint16_t		s_size;
+	static std::atomic<uint32_t> s_head;		// total number of records written
+
+	static void push(uint8_t level, const char* format, const uint32_t* args, uint8_t argc);
+	static size_t printRecord(Print &out, const Record &record);
+
+	template <typename T>
+	static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint32_t>::type
+	toArg(T value) { return (uint32_t) value; }
+
+	template <typename T>
+	static typename std::enable_if<std::is_floating_point<T>::value, uint32_t>::type
+	toArg(T value) {
+		float f = value;
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		return bits;
+	}
+
+	template <typename T>
+	static typename std::enable_if<std::is_pointer<T>::value, uint32_t>::type
+	toArg(T) { return 0; }
+};
+
+#endif
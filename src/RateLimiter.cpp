@@ -0,0 +1,89 @@
+#include "RateLimiter.h"
+#include "Utilities.h"
+
+
+// milliseconds to wait for a token
+static uint32_t waitTime(uint32_t full, uint32_t interval, uint8_t burst, uint32_t now)
+{
+	int32_t wait = (int32_t)(full - now) - (int32_t)(interval * (burst - 1));
+	return wait > 0 ? wait : 0;
+}
+
+
+// take a token: the bucket will be full one interval later
+static uint32_t takeToken(uint32_t full, uint32_t interval, uint32_t now)
+{
+	return ((int32_t)(full - now) > 0 ? full : now) + interval;
+}
+
+
+RateLimiter::Chat& RateLimiter::getChat(int64_t chatId, uint32_t now)
+{
+	Chat* oldest = &m_chats[0];
+	for (uint8_t i = 0; i < RATE_LIMIT_CHATS; i++) {
+		if (m_chats[i].id == chatId)
+			return m_chats[i];
+		if ((int32_t)(m_chats[i].full - oldest->full) < 0)
+			oldest = &m_chats[i];
+	}
+	// Not found: replace the chat that has been full for the longest time
+	// (if it's not full yet, messages to that chat will get a new full bucket)
+	oldest->id = chatId;
+	oldest->full = now;
+	return *oldest;
+}
+
+
+uint32_t RateLimiter::acquire(int64_t chatId)
+{
+	if (!m_enabled || chatId == 0)
+		return 0;
+
+	uint32_t now = millis();
+	lock();
+	uint32_t wait = take(chatId, now);
+	unlock();
+	return wait;
+}
+
+
+// acquire() with the lock held
+uint32_t RateLimiter::take(int64_t chatId, uint32_t now)
+{
+	if (m_paused) {
+		int32_t paused = (int32_t)(m_pausedUntil - now);
+		if (paused > 0)
+			return paused;
+		m_paused = false;
+	}
+
+	Chat &chat = getChat(chatId, now);
+	uint32_t wait = waitTime(m_global, RATE_LIMIT_GLOBAL_INTERVAL, RATE_LIMIT_GLOBAL_BURST, now);
+	uint32_t chatWait = waitTime(chat.full, RATE_LIMIT_CHAT_INTERVAL, RATE_LIMIT_CHAT_BURST, now);
+	if (chatWait > wait)
+		wait = chatWait;
+	if (wait > 0)
+		return wait;
+
+	m_global = takeToken(m_global, RATE_LIMIT_GLOBAL_INTERVAL, now);
+	chat.full = takeToken(chat.full, RATE_LIMIT_CHAT_INTERVAL, now);
+	return 0;
+}
+
+
+void RateLimiter::pause(uint32_t ms)
+{
+	uint32_t until = millis() + ms;
+	lock();
+	if (!m_paused || (int32_t)(until - m_pausedUntil) > 0)
+		m_pausedUntil = until;
+	m_paused = true;
+	unlock();
+}
+
+
+int64_t RateLimiter::channelId(const char* channel)
+{
+	// kept apart from real chat ids (they are lower than 2^53)
+	return (int64_t) fnv1a(channel, strlen(channel)) | (1LL << 60);
+}
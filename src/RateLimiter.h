@@ -0,0 +1,74 @@
+#ifndef RATE_LIMITER
+#define RATE_LIMITER
+
+#include <Arduino.h>
+
+#ifndef RATE_LIMIT_CHATS
+#define RATE_LIMIT_CHATS			16		// number of chats tracked at the same time
+#endif
+#ifndef RATE_LIMIT_CHAT_INTERVAL
+#define RATE_LIMIT_CHAT_INTERVAL	1000	// average time between messages to the same chat (ms)
+#endif
+#ifndef RATE_LIMIT_CHAT_BURST
+#define RATE_LIMIT_CHAT_BURST		3		// messages to the same chat that can be sent without waiting
+#endif
+#ifndef RATE_LIMIT_GLOBAL_INTERVAL
+#define RATE_LIMIT_GLOBAL_INTERVAL	34		// average time between messages to any chat (~30 messages/s)
+#endif
+#ifndef RATE_LIMIT_GLOBAL_BURST
+#define RATE_LIMIT_GLOBAL_BURST		30
+#endif
+
+
+// Token buckets for outgoing messages: one for each chat and a global one.
+// Buckets are stored as the time when they will be full again (virtual scheduling), so each
+// chat needs only its id and a timestamp in a fixed table. A chat whose bucket is full can be replaced.
+// The limiter never blocks: a message that can't be sent yet is held by the caller until the returned time.
+// On ESP32 it's used both by httpPostTask and by the loop task, so the table is guarded by a spinlock.
+class RateLimiter
+{
+public:
+	// take a token for a message to chatId
+	// returns:
+	//   0 if the message can be sent now, otherwise the milliseconds to wait before retrying
+	uint32_t acquire(int64_t chatId);
+
+	// stop all messages for a while (i.e. server replied with "429 Too Many Requests")
+	void pause(uint32_t ms);
+
+	inline void enable(bool value) { m_enabled = value; }
+
+	// chat "id" used for channel names ("@channel")
+	static int64_t channelId(const char* channel);
+
+private:
+	struct Chat {
+		int64_t		id;
+		uint32_t	full;		// time when the bucket will be full
+	};
+
+	Chat		m_chats[RATE_LIMIT_CHATS] = {};
+	uint32_t	m_global = 0;
+	uint32_t	m_pausedUntil = 0;
+	bool		m_paused = false;
+	bool		m_enabled = true;
+#if defined(ESP32)
+	portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+	Chat& getChat(int64_t chatId, uint32_t now);
+	uint32_t take(int64_t chatId, uint32_t now);
+
+	inline void lock() {
+#if defined(ESP32)
+		portENTER_CRITICAL(&m_lock);
+#endif
+	}
+	inline void unlock() {
+#if defined(ESP32)
+		portEXIT_CRITICAL(&m_lock);
+#endif
+	}
+};
+
+#endif
@@ -4,7 +4,7 @@
 
 ReplyKeyboard::ReplyKeyboard()
 {	
-	m_json = "{\"keyboard\":[[]]}\"";
+
 }
 
 ReplyKeyboard::~ReplyKeyboard() {} 
@@ -12,17 +12,7 @@ ReplyKeyboard::~ReplyKeyboard() {}
 
 bool ReplyKeyboard::addRow()
 {
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 128);	 // Current size + space for new row (empty)
-
-	deserializeJson(doc, m_json);
-	JsonArray rows = doc["keyboard"];	
-	rows.createNestedArray();
-	m_json.clear();
-	serializeJson(doc, m_json);
-	doc.shrinkToFit();
-	m_jsonSize = doc.memoryUsage();
-	return true;
+	return KeyboardLayout::addRow();
 }
 
 
@@ -32,82 +22,72 @@ bool ReplyKeyboard::addButton(const char* text, ReplyKeyboardButtonType buttonTy
 		(buttonType != KeyboardButtonLocation) && 
 		(buttonType != KeyboardButtonSimple))
 		return false;
-	// As reccomended use local JsonDocument instead global
-	// inline keyboard json structure will be stored in a String var	
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 256);	 // Current size + space for new object (button)
-	deserializeJson(doc, m_json);
-
-	JsonArray  rows = doc["keyboard"];	
-	JsonObject button = rows[rows.size()-1].createNestedObject();
-
-	button["text"] = text; 
-	switch (buttonType){
-		case KeyboardButtonContact:
-			button["request_contact"] = true;
-			break;
-		case KeyboardButtonLocation:
-			button["request_location"] = true;
-			break;	
-		default: 
-			break;
-	}
-
-	// Store inline keyboard json structure
-	m_json.clear();
-	serializeJson(doc, m_json);
-	doc.shrinkToFit();
-	m_jsonSize = doc.memoryUsage();
-	return true;
-
+	// Button is stored in the compact layout, JSON will be generated only when needed
+	return KeyboardLayout::addButton(text, nullptr, buttonType) >= 0;
 }
 
 
 void ReplyKeyboard::enableResize() 
 {
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 128);   // Current size + space for new field
-	deserializeJson(doc, m_json);
-	doc["resize_keyboard"] = true;
-	m_json.clear();
-	serializeJson(doc, m_json);
+	m_resize = true;
+	invalidate();
 }
 
 void ReplyKeyboard::enableOneTime() 
 {
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 128);	// Current size + space for new field
-	deserializeJson(doc, m_json);
-	doc["one_time_keyboard"] = true;
-	m_json.clear();
-	serializeJson(doc, m_json);
+	m_oneTime = true;
+	invalidate();
 }
 
 void ReplyKeyboard::enableSelective() 
 {	
-	if(m_jsonSize < BUFFER_MEDIUM) m_jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(m_jsonSize + 128);  // Current size + space for new field
-	deserializeJson(doc, m_json);
-	doc["selective"] = true;
-	m_json.clear();
-	serializeJson(doc, m_json);
+	m_selective = true;
+	invalidate();
 }
 
+
+void ReplyKeyboard::writeJSON(JsonWriter &out) const
+{
+	writeRows(out, "keyboard");
+	if (m_resize)
+		out.raw(",\"resize_keyboard\":true");
+	if (m_oneTime)
+		out.raw(",\"one_time_keyboard\":true");
+	if (m_selective)
+		out.raw(",\"selective\":true");
+	out.raw('}');
+}
+
+
+void ReplyKeyboard::writeButton(JsonWriter &out, const KeyboardButton &button) const
+{
+	switch (button.type){
+		case KeyboardButtonContact:
+			out.raw(",\"request_contact\":true");
+			break;
+		case KeyboardButtonLocation:
+			out.raw(",\"request_location\":true");
+			break;	
+		default: 
+			break;
+	}
+}
+
+
 String ReplyKeyboard::getJSON() const
 {
-	return m_json;
+	return buildJSON();
 }
 
 String ReplyKeyboard::getJSONPretty() const
 {
-	uint16_t jsonSize;
-	if(m_jsonSize < BUFFER_MEDIUM) jsonSize = BUFFER_MEDIUM;	
-	DynamicJsonDocument doc(jsonSize + 128);	// Current size + space for new lines
-	deserializeJson(doc, m_json);
+	// Only for debug prints, never called by the library: a keyboard doesn't know the bot arena,
+	// so this temporary document is taken from the heap
+	DynamicJsonDocument doc(measureJSON() * 2 + 128);	// Current size + space for parsed structure
+	deserializeJson(doc, buildJSON());
 
 	String serialized;		
 	serializeJsonPretty(doc, serialized);
 	return serialized;
 }
 
-
@@ -8,6 +8,7 @@
 #include <ArduinoJson.h>
 #include <Arduino.h>
 #include "DataStructures.h"
+#include "KeyboardLayout.h"
 
 enum ReplyKeyboardButtonType {
 	KeyboardButtonSimple   = 1,
@@ -16,11 +17,15 @@ enum ReplyKeyboardButtonType {
 };
 
 
-class ReplyKeyboard
+class ReplyKeyboard : public KeyboardLayout
 {
 private:
-	String m_json;
-	size_t m_jsonSize = BUFFER_MEDIUM;
+	bool m_resize = false;
+	bool m_oneTime = false;
+	bool m_selective = false;
+
+	void writeJSON(JsonWriter &out) const override;
+	void writeButton(JsonWriter &out, const KeyboardButton &button) const override;
 
 public:
 	ReplyKeyboard();
@@ -0,0 +1,213 @@
+#ifndef REQUEST_QUEUE
+#define REQUEST_QUEUE
+
+#include <Arduino.h>
+#include <atomic>
+#include <utility>
+
+// What to do when a new request is pushed and the queue is full
+enum QueueOverflowPolicy {
+	QueueBlock      = 0,	// wait (up to the timeout) until a slot is freed
+	QueueDropOldest = 1,	// discard the oldest pending request
+	QueueFail       = 2		// reject the new request
+};
+
+
+// A request waiting to be sent to the Telegram server
+struct TBRequest {
+	String command;
+	String param;
+	int64_t chatId = 0;		// destination chat for rate limiting (0: not limited)
+	bool resent = false;	// already rejected once with "429 Too Many Requests"
+};
+
+
+// Bounded lock-free queue between the Arduino loop() (producer) and the httpPostTask (consumer).
+// Every slot carries its own sequence number (D. Vyukov bounded queue), so the slot is handed from
+// one side to the other only when data has been completely moved in or out. This also allows
+// the producer to safely act as a second consumer for discarding the oldest element.
+// N must be a power of two.
+template <typename T, uint8_t N>
+class RequestQueue
+{
+	static_assert(N > 1 && (N & (N - 1)) == 0, "RequestQueue size must be a power of two");
+
+public:
+	RequestQueue() {
+		for (uint32_t i = 0; i < N; i++)
+			m_slots[i].sequence.store(i, std::memory_order_relaxed);
+		m_head.store(0, std::memory_order_relaxed);
+		m_tail.store(0, std::memory_order_relaxed);
+	}
+
+	// Add a new element (producer side only). Item content is moved into the queue.
+	// params:
+	//   item   : the element to add
+	//   policy : the policy to apply if the queue is full
+	//   timeout: max waiting time in milliseconds with QueueBlock policy
+	// returns:
+	//   true if the element was accepted
+	inline bool push(T &item, QueueOverflowPolicy policy, uint32_t timeout) {
+		return push(item, policy, timeout, [](T &) {});
+	}
+
+	// Same as push(), onDrop(element) is called for every element discarded with QueueDropOldest
+	// policy (i.e. to release what the element was holding)
+	template <typename OnDrop>
+	bool push(T &item, QueueOverflowPolicy policy, uint32_t timeout, OnDrop onDrop) {
+		uint32_t start = millis();
+		while (!tryPush(item)) {
+			switch (policy) {
+				case QueueFail:
+					m_rejected++;
+					return false;
+				case QueueDropOldest: {
+					T oldest;
+					if (pop(oldest)) {
+						m_dropped++;
+						onDrop(oldest);
+					}
+					break;
+				}
+				default:
+					if (millis() - start > timeout) {
+						m_rejected++;
+						return false;
+					}
+					delay(1);
+					break;
+			}
+		}
+		return true;
+	}
+
+	// Get the oldest element. Item content is moved out from the queue.
+	// returns:
+	//   false if queue is empty
+	bool pop(T &item) {
+		uint32_t pos = m_tail.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot &slot = m_slots[pos % N];
+			int32_t diff = (int32_t)(slot.sequence.load(std::memory_order_acquire) - (pos + 1));
+			if (diff == 0) {
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					item = std::move(slot.data);
+					slot.sequence.store(pos + N, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Number of elements waiting in queue
+	inline uint8_t size() const {
+		return m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed);
+	}
+
+	// Number of elements discarded with QueueDropOldest policy
+	inline uint32_t dropped() const { return m_dropped; }
+
+	// Number of elements refused with QueueFail or QueueBlock (timeout) policy
+	inline uint32_t rejected() const { return m_rejected; }
+
+private:
+	struct Slot {
+		std::atomic<uint32_t> sequence;
+		T data;
+	};
+
+	Slot m_slots[N];
+	std::atomic<uint32_t> m_head;
+	std::atomic<uint32_t> m_tail;
+	uint32_t m_dropped = 0;
+	uint32_t m_rejected = 0;
+
+	bool tryPush(T &item) {
+		uint32_t pos = m_head.load(std::memory_order_relaxed);
+		Slot &slot = m_slots[pos % N];
+		// Slot is still owned by the consumer (queue full)
+		if (slot.sequence.load(std::memory_order_acquire) != pos)
+			return false;
+		slot.data = std::move(item);
+		m_head.store(pos + 1, std::memory_order_relaxed);
+		slot.sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+
+// Messages waiting for the rate limiter, in order of arrival. A message can be taken only when it's
+// the oldest one held for its chat: order is kept for each chat, while messages to other chats and
+// the requests that are not limited go on. Used by a single task (httpPostTask on ESP32, loop() on ESP8266).
+template <uint8_t N>
+class HeldRequests
+{
+public:
+	// Add a message. Content is moved into the list.
+	// params:
+	//   request: the message
+	//   first  : put it before all the others (i.e. a message to send again)
+	// returns:
+	//   false if the list is full
+	bool add(TBRequest &request, bool first = false) {
+		if (m_count == N)
+			return false;
+		uint8_t pos = first ? 0 : m_count;
+		for (uint8_t i = m_count; i > pos; i--)
+			m_items[i] = std::move(m_items[i - 1]);
+		m_items[pos] = std::move(request);
+		m_count++;
+		return true;
+	}
+
+	// returns:
+	//   true if a message to chatId is held
+	bool contains(int64_t chatId) const {
+		for (uint8_t i = 0; i < m_count; i++) {
+			if (m_items[i].chatId == chatId)
+				return true;
+		}
+		return false;
+	}
+
+	// Take the oldest message that can be sent now. Content is moved out from the list.
+	// params:
+	//   request: the message taken
+	//   ready  : ready(chatId) returns true if a message to that chat can be sent now
+	// returns:
+	//   false if no message can be sent
+	template <typename Ready>
+	bool take(TBRequest &request, Ready ready) {
+		for (uint8_t i = 0; i < m_count; i++) {
+			if (heldBefore(i) || !ready(m_items[i].chatId))
+				continue;
+			request = std::move(m_items[i]);
+			for (uint8_t j = i + 1; j < m_count; j++)
+				m_items[j - 1] = std::move(m_items[j]);
+			m_count--;
+			return true;
+		}
+		return false;
+	}
+
+	inline uint8_t size() const { return m_count; }
+
+private:
+	TBRequest m_items[N];
+	volatile uint8_t m_count = 0;		// read by pendingRequests() from loop()
+
+	// true if an older message to the same chat of item i is held
+	bool heldBefore(uint8_t i) const {
+		for (uint8_t j = 0; j < i; j++) {
+			if (m_items[j].chatId == m_items[i].chatId)
+				return true;
+		}
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "StartupCache.h"
+#include "Utilities.h"
+
+#if defined(ESP32)
+// Not initialized on power on (checked with crc), kept during deep sleep and soft reset
+RTC_NOINIT_ATTR static TBStartupCache rtcCache;
+#endif
+
+
+uint32_t TBStartupCache::hash(const uint8_t* data, size_t len)
+{
+	return fnv1a(data, len);
+}
+
+
+bool TBStartupCache::load(fs::FS* fs, const char* path, const char* token)
+{
+	bool ok = false;
+	if (fs != nullptr) {
+		File file = fs->open(path, "r");
+		if (file) {
+			ok = file.read((uint8_t*) this, sizeof(TBStartupCache)) == sizeof(TBStartupCache);
+			file.close();
+		}
+	}
+	else {
+#if defined(ESP32)
+		memcpy(this, &rtcCache, sizeof(TBStartupCache));
+		ok = true;
+#elif defined(ESP8266)
+		ok = ESP.rtcUserMemoryRead(0, (uint32_t*) this, sizeof(TBStartupCache));
+#endif
+	}
+
+	return ok && magic == STARTUP_CACHE_MAGIC
+		&& tokenHash == hash((const uint8_t*) token, strlen(token))
+		&& crc == hash((const uint8_t*) this, offsetof(TBStartupCache, crc))
+		&& username[sizeof(username) - 1] == '\0' && firstName[sizeof(firstName) - 1] == '\0';
+}
+
+
+bool TBStartupCache::save(fs::FS* fs, const char* path, const char* token)
+{
+	magic = STARTUP_CACHE_MAGIC;
+	tokenHash = hash((const uint8_t*) token, strlen(token));
+	crc = hash((const uint8_t*) this, offsetof(TBStartupCache, crc));
+
+	if (fs != nullptr) {
+		File file = fs->open(path, "w");
+		if (!file)
+			return false;
+		bool ok = file.write((const uint8_t*) this, sizeof(TBStartupCache)) == sizeof(TBStartupCache);
+		file.close();
+		return ok;
+	}
+#if defined(ESP32)
+	memcpy(&rtcCache, this, sizeof(TBStartupCache));
+	return true;
+#elif defined(ESP8266)
+	return ESP.rtcUserMemoryWrite(0, (uint32_t*) this, sizeof(TBStartupCache));
+#endif
+}
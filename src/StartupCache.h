@@ -0,0 +1,44 @@
+#ifndef STARTUP_CACHE
+#define STARTUP_CACHE
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <FS.h>
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>
+#endif
+
+#define STARTUP_CACHE_MAGIC		0x54424331UL	// "TBC1"
+#define STARTUP_CACHE_FILE		"/telegram.bin"
+
+// Data needed for starting the bot without waiting for getMe (and a new TLS handshake on ESP8266).
+// It's saved in RTC memory (kept during deep sleep) or in a file.
+struct alignas(4) TBStartupCache {
+	uint32_t	magic;
+	uint32_t	tokenHash;		// cache is discarded if the bot token has been changed
+	int32_t		botId;
+	int32_t		lastUpdate;		// offset of next getUpdates request
+	char		username[33];
+	char		firstName[65];
+#if defined(ESP8266)
+	bool		hasSession;
+	uint8_t		session[sizeof(br_ssl_session_parameters)];
+#endif
+	uint32_t	crc;
+
+	// returns:
+	//   true if data has been read and it's valid for this token
+	bool load(fs::FS* fs, const char* path, const char* token);
+
+	// returns:
+	//   true if data has been written
+	bool save(fs::FS* fs, const char* path, const char* token);
+
+	static uint32_t hash(const uint8_t* data, size_t len);
+};
+
+#if defined(ESP8266)
+static_assert(sizeof(TBStartupCache) <= 512, "TBStartupCache doesn't fit in RTC user memory");
+#endif
+
+#endif
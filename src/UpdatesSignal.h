@@ -0,0 +1,61 @@
+#ifndef UPDATES_SIGNAL
+#define UPDATES_SIGNAL
+
+#include <Arduino.h>
+
+#if !defined(ESP32)
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#endif
+
+
+// Binary signal given by the network task when new updates are ready and taken by the
+// application task waiting for them (a signal given while nobody waits is kept for the next wait).
+// FreeRTOS binary semaphore on ESP32; on other targets (i.e. a host build of the library)
+// a condition variable does the same.
+class UpdatesSignal
+{
+public:
+#if defined(ESP32)
+	UpdatesSignal() { m_semaphore = xSemaphoreCreateBinary(); }
+	~UpdatesSignal() { vSemaphoreDelete(m_semaphore); }
+
+	inline void give() { xSemaphoreGive(m_semaphore); }
+
+	// wait for the signal
+	// params
+	//   timeout: max waiting time in milliseconds
+	// returns
+	//   true if the signal was given
+	inline bool take(uint32_t timeout) { return xSemaphoreTake(m_semaphore, pdMS_TO_TICKS(timeout)) == pdTRUE; }
+
+private:
+	SemaphoreHandle_t m_semaphore;
+#else
+	UpdatesSignal() = default;
+
+	inline void give() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_given = true;
+		m_condition.notify_one();
+	}
+
+	inline bool take(uint32_t timeout) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		bool given = m_condition.wait_for(lock, std::chrono::milliseconds(timeout), [this] { return m_given; });
+		m_given = false;
+		return given;
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_given = false;
+#endif
+
+	UpdatesSignal(const UpdatesSignal&) = delete;
+	UpdatesSignal& operator=(const UpdatesSignal&) = delete;
+};
+
+#endif
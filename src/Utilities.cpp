@@ -1,49 +1,224 @@
 #include "Utilities.h"
 
+// true if one of the bytes of a 32 bit word is zero
+static inline bool hasZeroByte(uint32_t word)
+{
+	return ((word - 0x01010101UL) & ~word & 0x80808080UL) != 0;
+}
+
+
+// value of an hex digit
+static bool readHexDigit(char c, uint8_t &nibble)
+{
+	if (c >= '0' && c <= '9')		nibble = c - '0';
+	else if (c >= 'a' && c <= 'f')	nibble = c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')	nibble = c - 'A' + 10;
+	else return false;
+	return true;
+}
+
+
+// read 4 hex digits (stops at the first invalid char, so it never reads past the terminator)
+static bool readHex4(const char* text, uint16_t &value)
+{
+	value = 0;
+	for (uint8_t i = 0; i < 4; i++) {
+		uint8_t nibble;
+		if (!readHexDigit(text[i], nibble))
+			return false;
+		value = (value << 4) | nibble;
+	}
+	return true;
+}
+
+
+// write a code point as UTF-8
+// returns
+//   the number of bytes written (1 to 4)
+static uint8_t writeUTF8(uint32_t code, char* out)
+{
+	if (code < 0x80) {
+		out[0] = code;
+		return 1;
+	}
+	if (code < 0x800) {
+		out[0] = 0xC0 | (code >> 6);
+		out[1] = 0x80 | (code & 0x3F);
+		return 2;
+	}
+	if (code < 0x10000) {
+		out[0] = 0xE0 | (code >> 12);
+		out[1] = 0x80 | ((code >> 6) & 0x3F);
+		out[2] = 0x80 | (code & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (code >> 18);
+	out[1] = 0x80 | ((code >> 12) & 0x3F);
+	out[2] = 0x80 | ((code >> 6) & 0x3F);
+	out[3] = 0x80 | (code & 0x3F);
+	return 4;
+}
+
+
+size_t decodeUnicodeEscapes(char* text)
+{
+	const char* in = text;
+	char* out = text;
+	for (;;) {
+		// Fast path: copy 4 bytes at a time while there is no '\' and no terminator.
+		// Words are read only when aligned, so they never cross the end of the buffer
+		if (((uintptr_t) in & 3) == 0) {
+			for (;;) {
+				uint32_t word;
+				memcpy(&word, in, 4);
+				if (hasZeroByte(word) || hasZeroByte(word ^ 0x5C5C5C5CUL))
+					break;
+				if (out != in)
+					memcpy(out, &word, 4);
+				in += 4;
+				out += 4;
+			}
+		}
+
+		char c = *in;
+		if (c == '\0')
+			break;
+		uint16_t unit;
+		if (c != '\\' || in[1] != 'u' || !readHex4(in + 2, unit)) {
+			*out++ = *in++;
+			continue;
+		}
+
+		// \uXXXX (6 chars) produces at most 3 bytes, a surrogate pair (12 chars) 4 bytes
+		uint32_t code = unit;
+		in += 6;
+		if (unit >= 0xD800 && unit <= 0xDBFF) {
+			uint16_t low;
+			if (in[0] == '\\' && in[1] == 'u' && readHex4(in + 2, low) && low >= 0xDC00 && low <= 0xDFFF) {
+				code = 0x10000 + ((uint32_t) (unit - 0xD800) << 10) + (low - 0xDC00);
+				in += 6;
+			}
+			else
+				code = 0xFFFD;
+		}
+		else if (unit >= 0xDC00 && unit <= 0xDFFF)
+			code = 0xFFFD;
+		out += writeUTF8(code, out);
+	}
+	*out = '\0';
+	return out - text;
+}
+
+
+bool unicodeToUTF8(String unicode, String &utf8)
+{
+	// Decoded text is never longer than the original one
+	unsigned int len = unicode.length();
+	utf8 = unicode;
+	if (utf8.length() != len)
+		return false;		// out of memory
+	if (len > 0)
+		utf8.remove(decodeUnicodeEscapes(utf8.begin()));
+	return true;
+}
+
+
 String toUTF8(String message)
 {
-	String converted;
-	uint16_t i = 0;
-	while (i < message.length()) {
-		String subMessage(message[i]);
-		if (message[i] != '\\') {
-			converted += subMessage;
-			i++;
-		} else {
-			// found "\"
-			i++;
-			if (i == message.length()) {
-				// no more characters
-				converted += subMessage;
-			} else {
-				subMessage += (String)message[i];
-				if (message[i] != 'u') {
-					converted += subMessage;
-					i++;
-				} else {
-					//found \u escape code
-					i++;
-					if (i == message.length()) {
-						// no more characters
-						converted += subMessage;
-					} else {
-						uint8_t j = 0;
-						while ((j < 4) && ((j + i) < message.length())) {
-							subMessage += (String)message[i + j];
-							j++;
-						}
-						i += j;
-						String utf8;
-						if (unicodeToUTF8(subMessage, utf8))
-							converted += utf8;
-						else
-							converted += subMessage;
-					}
-				}
+	if (message.length() > 0)
+		message.remove(decodeUnicodeEscapes(message.begin()));
+	return message;
+}
+
+
+const char* escapeChar(char c, TextEscape mode)
+{
+	if (mode == EscapeHTML) {
+		switch (c) {
+			case '<':	return "&lt;";
+			case '>':	return "&gt;";
+			case '&':	return "&amp;";
+			case '"':	return "&quot;";
+			default:	return nullptr;
+		}
+	}
+	if (mode == EscapeMarkdownV2) {
+		switch (c) {
+			case '_':	return "\\_";
+			case '*':	return "\\*";
+			case '[':	return "\\[";
+			case ']':	return "\\]";
+			case '(':	return "\\(";
+			case ')':	return "\\)";
+			case '~':	return "\\~";
+			case '`':	return "\\`";
+			case '>':	return "\\>";
+			case '#':	return "\\#";
+			case '+':	return "\\+";
+			case '-':	return "\\-";
+			case '=':	return "\\=";
+			case '|':	return "\\|";
+			case '{':	return "\\{";
+			case '}':	return "\\}";
+			case '.':	return "\\.";
+			case '!':	return "\\!";
+			case '\\':	return "\\\\";
+			default:	return nullptr;
+		}
+	}
+	return nullptr;
+}
+
+
+size_t escapeText(const char* text, char* out, size_t size, TextEscape mode)
+{
+	size_t len = 0;
+	size_t written = 0;
+	bool truncated = out == nullptr || size == 0;
+	for (const char* c = text; *c != '\0'; c++) {
+		const char* escaped = escapeChar(*c, mode);
+		size_t n = escaped != nullptr ? strlen(escaped) : 1;
+		if (!truncated && written + n >= size) {
+			truncated = true;
+			// Don't cut an UTF-8 character
+			if (((uint8_t) *c & 0xC0) == 0x80) {
+				while (written > 0 && ((uint8_t) out[written - 1] & 0xC0) == 0x80)
+					written--;
+				if (written > 0 && ((uint8_t) out[written - 1] & 0xC0) == 0xC0)
+					written--;
 			}
 		}
+		if (!truncated) {
+			if (escaped != nullptr)
+				memcpy(out + written, escaped, n);
+			else
+				out[written] = *c;
+			written += n;
+		}
+		len += n;
 	}
-	return converted;
+	if (out != nullptr && size > 0)
+		out[written] = '\0';
+	return len;
+}
+
+
+String escapeText(const char* text, TextEscape mode)
+{
+	String escaped((char *)0);
+	escaped.reserve(escapeText(text, nullptr, 0, mode));
+	// Plain characters are copied in runs
+	const char* run = text;
+	for (const char* c = text; *c != '\0'; c++) {
+		const char* sequence = escapeChar(*c, mode);
+		if (sequence != nullptr) {
+			escaped.concat(run, c - run);
+			escaped += sequence;
+			run = c + 1;
+		}
+	}
+	escaped += run;
+	return escaped;
 }
 
 String int64ToAscii(int64_t value) {
@@ -65,4 +240,50 @@ String int64ToAscii(int64_t value) {
 	if (value < 0)
 		buffer = '-' + buffer;
 	return buffer;
-}
\ No newline at end of file
+}
+
+
+size_t int64ToChars(int64_t value, char* buffer) {
+	char digits[20];
+	uint8_t count = 0;
+	uint64_t temp = value < 0 ? -(uint64_t) value : (uint64_t) value;
+	do {
+		digits[count++] = '0' + temp % 10;
+		temp /= 10;
+	} while (temp != 0);
+
+	size_t len = 0;
+	if (value < 0)
+		buffer[len++] = '-';
+	while (count > 0)
+		buffer[len++] = digits[--count];
+	buffer[len] = '\0';
+	return len;
+}
+
+
+uint32_t fnv1a(const void* data, size_t len, bool lowerCase)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+	uint32_t h = 2166136261UL;
+	for (size_t i = 0; i < len; i++) {
+		uint8_t c = bytes[i];
+		if (lowerCase && c >= 'A' && c <= 'Z')
+			c += 32;
+		h ^= c;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+
+bool hexToBytes(const char* hex, uint8_t* out, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		uint8_t high, low;
+		if (!readHexDigit(hex[2 * i], high) || !readHexDigit(hex[2 * i + 1], low))
+			return false;
+		out[i] = (high << 4) | low;
+	}
+	return true;
+}
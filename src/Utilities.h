@@ -5,6 +5,22 @@
 
 
 
+// How reserved characters of a text are escaped for the parse mode of a message
+enum TextEscape {
+	EscapeNone       = 0,
+	EscapeMarkdownV2 = 1,	// backslash before _*[]()~`>#+-=|{}.! and the backslash itself
+	EscapeHTML       = 2	// < > & " are replaced by entities
+};
+
+
+// decode the \uXXXX escape sequences of a text to UTF-8, in place (the text can only become shorter).
+// Surrogate pairs are joined, a lone surrogate becomes U+FFFD. Other backslashes are left as-is
+// params
+//   text: the null terminated text to decode
+// returns
+//   the new length of the text
+size_t decodeUnicodeEscapes(char* text);
+
 // convert an UNICODE coded string to a UTF8 coded string
 // params
 //   unicode: the UNICODE string to convert
@@ -21,6 +37,26 @@ bool unicodeToUTF8(String unicode, String &utf8);
 //   a string with the converted message in UTF8 
 String toUTF8(String message);
 
+// escape the reserved characters of a text for a parse mode (i.e. text written by a user)
+// params
+//   text: the text to escape
+//   out : destination buffer (nullptr to get only the needed length)
+//   size: size of destination buffer, the text is truncated (on a whole character) if too small
+//   mode: the parse mode
+// returns
+//   the length of the whole escaped text, as snprintf()
+size_t escapeText(const char* text, char* out, size_t size, TextEscape mode);
+
+// escape a text for a parse mode
+// returns
+//   a new string with the escaped text
+String escapeText(const char* text, TextEscape mode);
+
+// returns
+//   the text that replaces a character for a parse mode (i.e. "&lt;" for '<' or "\\." for '.'),
+//   nullptr if the character is written as-is
+const char* escapeChar(char c, TextEscape mode);
+
 // convert an int64 value to an ASCII string
 // params
 //   value: the int64 value
@@ -28,5 +64,31 @@ String toUTF8(String message);
 //   the ASCII string of the converted value 
 String int64ToAscii(int64_t value);
 
+// convert an int64 value to ASCII in a char buffer (without allocations)
+// params
+//   value : the int64 value
+//   buffer: destination, at least 21 chars
+// returns
+//   the length of the string
+size_t int64ToChars(int64_t value, char* buffer);
+
+// convert a string of hex digits to bytes (stops at the first invalid digit)
+// params
+//   hex : the hex digits, two for each byte
+//   out : destination buffer
+//   size: number of bytes to convert
+// returns
+//   false if the string has less than size * 2 hex digits
+bool hexToBytes(const char* hex, uint8_t* out, size_t size);
+
+// FNV-1a hash (32 bit) of a buffer
+// params
+//   data     : the bytes to hash
+//   len      : number of bytes
+//   lowerCase: hash A-Z as a-z (case insensitive keys)
+// returns
+//   the hash value
+uint32_t fnv1a(const void* data, size_t len, bool lowerCase = false);
+
 
 #endif
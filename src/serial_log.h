@@ -14,32 +14,51 @@
 
 #include "AsyncTelegram.h"
 
+
 #ifndef __LOG_H__
 #define __LOG_H__
 
-#ifdef __cplusplus
-extern "C"
-{
+#include "LogBuffer.h"
+
+// Log levels: messages above LOG_LEVEL are removed at compile time (no code, no strings).
+// Default is no log at all (as before), DEBUG_ENABLE selects the debug level
+#define LOG_LEVEL_NONE      0
+#define LOG_LEVEL_ERROR     1
+#define LOG_LEVEL_INFO      2
+#define LOG_LEVEL_DEBUG     3
+
+#ifndef LOG_LEVEL
+    #if DEBUG_ENABLE
+        #define LOG_LEVEL   LOG_LEVEL_DEBUG
+    #else
+        #define LOG_LEVEL   LOG_LEVEL_NONE
+    #endif
 #endif
 
 
 #define _LOG_FORMAT(letter, format)  "[" #letter "][%s:%u] %s():\t" format, __FILE__, __LINE__, __FUNCTION__
 
+// With LogBuffer enabled, a binary record is stored instead of printing (no UART wait)
+#define _LOG_WRITE(letter, level, format, ...) do { \
+    if (LogBuffer::enabled()) LogBuffer::write(level, format, ##__VA_ARGS__); \
+    else Serial.printf(_LOG_FORMAT(letter, format), ##__VA_ARGS__); } while (0)
 
-#if DEBUG_ENABLE
-#define log_debug(format, ...) Serial.printf(_LOG_FORMAT(D, format), ##__VA_ARGS__)
-#define log_error(format, ...) { Serial.println(); Serial.printf(_LOG_FORMAT(E, format), ##__VA_ARGS__); }
-#define log_info(format, ...) Serial.printf(_LOG_FORMAT(I, format), ##__VA_ARGS__)
-#define lineTrap() {Serial.printf("[%s:%u] - ", __FILE__, __LINE__); Serial.print(__func__); Serial.println("()");}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define log_error(format, ...) _LOG_WRITE(E, LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define log_error(format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(format, ...) _LOG_WRITE(I, LOG_LEVEL_INFO, format, ##__VA_ARGS__)
 #else
-#define log_debug(format, ...)
-#define log_error(format, ...)
-#define log_info(format, ...)
-#define lineTRap()
+#define log_info(format, ...) do {} while (0)
 #endif
 
-#define DEBUG_F true
-#if DEBUG_F
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(format, ...) _LOG_WRITE(D, LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define lineTrap() {Serial.printf("[%s:%u] - ", __FILE__, __LINE__); Serial.print(__func__); Serial.println("()");}
 	#ifdef ESP32
 		#define functionLog() { \
 		Serial.printf("Heap memory %6d / %6d", heap_caps_get_free_size(0), heap_caps_get_largest_free_block(0));\
@@ -50,15 +69,9 @@ extern "C"
 		Serial.printf("[%s:%u]\t--- ", __FILE__, __LINE__); Serial.print(millis()); Serial.print("mS > ");  Serial.print(__func__); Serial.println("()"); }
 	#endif
 #else
-    #define functionLog()
-#endif
-
-
-
-
-
-#ifdef __cplusplus
-}
+#define log_debug(format, ...) do {} while (0)
+#define lineTrap()
+#define functionLog()
 #endif
 
-#endif /* __ESP_LOGGING_H__ */
+#endif /* __LOG_H__ */